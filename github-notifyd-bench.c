@@ -0,0 +1,676 @@
+/* github-notifyd-bench - display path benchmark with a fake notification server
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <jansson.h>
+
+#define NOTIFICATIONS_NAME           "org.freedesktop.Notifications"
+#define NOTIFICATIONS_PATH           "/org/freedesktop/Notifications"
+#define GITHUB_API_NOTIFICATIONS     "https://api.github.com/notifications"
+#define BENCH_COMMENTS_URL           "https://api.github.com/repos/bench/repo/issues/comments/"
+#define RESPONSE_HEADERS             "HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\n\r\n"
+
+
+/*
+ * notification servers - caps and server information as they report them,
+ * show_notification() has quirks for some of them
+ */
+typedef struct
+{
+  const gchar  *id;
+  const gchar  *name;
+  const gchar  *vendor;
+  const gchar  *version;
+  const gchar  *spec_version;
+  const gchar  *caps;
+} vendor_profile;
+
+static const vendor_profile profiles[] =
+{
+  { "gnome", "gnome-shell", "GNOME", "3.38.1", "1.2",
+    "actions,body,body-markup,icon-static,persistence,sound" },
+  { "kde", "Plasma", "KDE", "2.0", "1.2",
+    "body,body-hyperlinks,body-images,body-markup,icon-static,actions,persistence,inline-reply,x-kde-urls" },
+  { "kde4", "Plasma", "KDE", "1.0", "1.1",
+    "body,body-hyperlinks,body-markup,icon-static,actions" },
+  { "xfce", "Xfce Notify Daemon", "Xfce", "0.6.2", "1.2",
+    "actions,body,body-hyperlinks,body-markup,icon-static,persistence,x-canonical-private-icon-only" },
+  { "unity", "notify-osd", "Canonical Ltd", "1.0", "1.1",
+    "body,body-markup,icon-static,image/svg+xml,x-canonical-private-synchronous,x-canonical-append" },
+  { "dunst", "dunst", "knopwob", "1.5.0", "1.2",
+    "actions,body,body-hyperlinks,body-markup,icon-static,persistence" },
+  { NULL }
+};
+
+static const gchar introspection_xml[] =
+  "<node>"
+  "  <interface name='org.freedesktop.Notifications'>"
+  "    <method name='GetCapabilities'>"
+  "      <arg type='as' name='caps' direction='out'/>"
+  "    </method>"
+  "    <method name='Notify'>"
+  "      <arg type='s' name='app_name' direction='in'/>"
+  "      <arg type='u' name='replaces_id' direction='in'/>"
+  "      <arg type='s' name='app_icon' direction='in'/>"
+  "      <arg type='s' name='summary' direction='in'/>"
+  "      <arg type='s' name='body' direction='in'/>"
+  "      <arg type='as' name='actions' direction='in'/>"
+  "      <arg type='a{sv}' name='hints' direction='in'/>"
+  "      <arg type='i' name='expire_timeout' direction='in'/>"
+  "      <arg type='u' name='id' direction='out'/>"
+  "    </method>"
+  "    <method name='CloseNotification'>"
+  "      <arg type='u' name='id' direction='in'/>"
+  "    </method>"
+  "    <method name='GetServerInformation'>"
+  "      <arg type='s' name='name' direction='out'/>"
+  "      <arg type='s' name='vendor' direction='out'/>"
+  "      <arg type='s' name='version' direction='out'/>"
+  "      <arg type='s' name='spec_version' direction='out'/>"
+  "    </method>"
+  "    <signal name='NotificationClosed'>"
+  "      <arg type='u' name='id'/>"
+  "      <arg type='u' name='reason'/>"
+  "    </signal>"
+  "    <signal name='ActionInvoked'>"
+  "      <arg type='u' name='id'/>"
+  "      <arg type='s' name='action_key'/>"
+  "    </signal>"
+  "  </interface>"
+  "</node>";
+
+static gint opt_burst = 50;
+static gint opt_bursts = 1;
+static gint opt_latency = 0;
+static gint opt_timeout = 30;
+static gchar *opt_vendor = NULL;
+static gchar *opt_daemon = NULL;
+
+static GMainLoop *mainloop;
+static const vendor_profile *profile = NULL;
+static GArray *arrivals = NULL;
+static guint32 last_id = 0;
+static GPid daemon_pid = 0;
+static gboolean daemon_running = FALSE;
+static gboolean name_acquired = FALSE;
+static gboolean timed_out = FALSE;
+
+GOptionEntry entries[] =
+{
+  { "burst", 'n', 0, G_OPTION_ARG_INT, &opt_burst, "Notifications in one poll [default: 50]", "N"},
+  { "bursts", 'b', 0, G_OPTION_ARG_INT, &opt_bursts, "Bursts per notification server, each with a fresh daemon [default: 1]", "N"},
+  { "latency", 'l', 0, G_OPTION_ARG_INT, &opt_latency, "Latency of every call to the fake server [default: 0ms]", "MS"},
+  { "timeout", 't', 0, G_OPTION_ARG_INT, &opt_timeout, "Give up on a burst after this long [default: 30s]", "SECONDS"},
+  { "vendor", 'v', 0, G_OPTION_ARG_STRING, &opt_vendor, "Emulate only this server: gnome, kde, kde4, xfce, unity or dunst", "ID"},
+  { "daemon", 'd', 0, G_OPTION_ARG_FILENAME, &opt_daemon, "github-notifyd binary [default: ./github-notifyd]", "PATH"},
+  { NULL }
+};
+
+
+/*
+ * fake notification server
+ */
+typedef struct
+{
+  GDBusMethodInvocation  *invocation;
+  GVariant               *reply;
+} delayed_reply;
+
+static gboolean
+send_reply (gpointer user_data)
+{
+  delayed_reply *reply;
+
+  reply = (delayed_reply*) user_data;
+  g_dbus_method_invocation_return_value (reply->invocation, reply->reply);
+  g_free (reply);
+
+  return FALSE;
+}
+
+static void
+reply_later (GDBusMethodInvocation  *invocation,
+             GVariant               *value)
+{
+  delayed_reply *reply;
+
+  if (opt_latency <= 0)
+    {
+      g_dbus_method_invocation_return_value (invocation, value);
+      return;
+    }
+
+  /* the server stays responsive, the caller just waits longer */
+  reply = g_new0 (delayed_reply, 1);
+  reply->invocation = invocation;
+  reply->reply = value;
+  g_timeout_add (opt_latency, send_reply, reply);
+}
+
+static void
+handle_method_call (GDBusConnection        *connection,
+                    const gchar            *sender,
+                    const gchar            *object_path,
+                    const gchar            *interface_name,
+                    const gchar            *method_name,
+                    GVariant               *parameters,
+                    GDBusMethodInvocation  *invocation,
+                    gpointer                user_data)
+{
+  GVariantBuilder builder;
+  gchar **caps;
+  gint64 now;
+  guint i;
+
+  if (!g_strcmp0 (method_name, "GetCapabilities"))
+    {
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+      caps = g_strsplit (profile->caps, ",", -1);
+      for (i = 0; caps [i]; i++)
+        g_variant_builder_add (&builder, "s", caps [i]);
+      g_strfreev (caps);
+
+      reply_later (invocation, g_variant_new ("(as)", &builder));
+    }
+  else if (!g_strcmp0 (method_name, "GetServerInformation"))
+    {
+      reply_later (invocation, g_variant_new ("(ssss)", profile->name, profile->vendor,
+                                              profile->version, profile->spec_version));
+    }
+  else if (!g_strcmp0 (method_name, "Notify"))
+    {
+      now = g_get_monotonic_time ();
+      g_array_append_val (arrivals, now);
+
+      reply_later (invocation, g_variant_new ("(u)", ++last_id));
+
+      if (arrivals->len >= (guint) opt_burst)
+        g_main_loop_quit (mainloop);
+    }
+  else if (!g_strcmp0 (method_name, "CloseNotification"))
+    {
+      reply_later (invocation, NULL);
+    }
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+  handle_method_call,
+  NULL,
+  NULL
+};
+
+static void
+on_name_acquired (GDBusConnection  *connection,
+                  const gchar      *name,
+                  gpointer          user_data)
+{
+  name_acquired = TRUE;
+  g_main_loop_quit (mainloop);
+}
+
+
+/*
+ * canned API traffic for the daemon's --replay mode - one feed with
+ * a burst of notifications and the latest comment of each thread
+ */
+static gboolean
+write_exchange (const gchar  *dir,
+                guint         seq,
+                const gchar  *url,
+                json_t       *body)
+{
+  json_t *exchange;
+  gchar *path, *data;
+  gboolean success;
+
+  exchange = json_pack ("{s:s, s:s, s:[], s:i, s:i, s:i, s:i, s:s}",
+                        "method", "GET",
+                        "url", url,
+                        "request_headers",
+                        "code", 200,
+                        "status", 0,
+                        "first_byte_us", 0,
+                        "duration_us", 0,
+                        "response_headers", RESPONSE_HEADERS);
+
+  path = g_strdup_printf ("%s/%06u.json", dir, seq);
+  success = (json_dump_file (exchange, path, JSON_INDENT (2)) == 0);
+  g_free (path);
+  json_decref (exchange);
+
+  data = json_dumps (body, JSON_COMPACT);
+  path = g_strdup_printf ("%s/%06u.body", dir, seq);
+  success = success && g_file_set_contents (path, data, -1, NULL);
+  g_free (path);
+  free (data);
+
+  return success;
+}
+
+static gboolean
+write_recordings (const gchar *dir)
+{
+  json_t *feed, *comment;
+  GDateTime *now;
+  gchar *updated_at, *url, *id;
+  gboolean success;
+  gint i;
+
+  now = g_date_time_new_now_utc ();
+  updated_at = g_date_time_format (now, "%Y-%m-%dT%H:%M:%SZ");
+  g_date_time_unref (now);
+
+  success = TRUE;
+  feed = json_array ();
+
+  for (i = 0; i < opt_burst; i++)
+    {
+      id = g_strdup_printf ("%d", i + 1);
+      url = g_strdup_printf ("%s%s", BENCH_COMMENTS_URL, id);
+
+      json_array_append_new (feed, json_pack ("{s:s, s:s, s:s, s:{s:s, s:s, s:s}, s:{s:s, s:s, s:s}}",
+                                              "id", id,
+                                              "reason", (i % 3) ? "subscribed" : "mention",
+                                              "updated_at", updated_at,
+                                              "subject",
+                                                "type", "Issue",
+                                                "title", "Display path benchmark - a notification title of typical length",
+                                                "latest_comment_url", url,
+                                              "repository",
+                                                "name", "repo",
+                                                "html_url", "https://github.com/bench/repo",
+                                                "url", "https://api.github.com/repos/bench/repo"));
+
+      comment = json_pack ("{s:s, s:{s:s, s:i, s:s}}",
+                           "html_url", "https://github.com/bench/repo/issues/1#issuecomment-1",
+                           "user",
+                             "login", "octocat",
+                             "id", i + 1,
+                             "avatar_url", "https://avatars.githubusercontent.com/u/1?v=4");
+      success = success && write_exchange (dir, i + 2, url, comment);
+      json_decref (comment);
+      g_free (url);
+      g_free (id);
+    }
+
+  success = success && write_exchange (dir, 1, GITHUB_API_NOTIFICATIONS, feed);
+
+  json_decref (feed);
+  g_free (updated_at);
+
+  return success;
+}
+
+
+/*
+ * remove the scratch directory
+ */
+static void
+remove_tree (const gchar *path)
+{
+  const gchar *name;
+  gchar *child;
+  GDir *dir;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir)
+    {
+      while ((name = g_dir_read_name (dir)))
+        {
+          child = g_build_filename (path, name, NULL);
+          remove_tree (child);
+          g_free (child);
+        }
+      g_dir_close (dir);
+    }
+
+  g_remove (path);
+}
+
+
+/*
+ * one burst - a fresh daemon polls the canned feed once and shows it
+ */
+static void
+daemon_exited (GPid      pid,
+               gint      status,
+               gpointer  user_data)
+{
+  g_spawn_close_pid (pid);
+  daemon_running = FALSE;
+  g_main_loop_quit (mainloop);
+}
+
+static gboolean
+burst_timeout (gpointer user_data)
+{
+  timed_out = TRUE;
+  g_main_loop_quit (mainloop);
+  return FALSE;
+}
+
+static gboolean
+run_burst (const gchar  *scratch,
+           gchar       **envp)
+{
+  GError *error;
+  gchar *replay, *metrics, *status;
+  guint timeout_id;
+  gboolean success;
+
+  error = NULL;
+  success = FALSE;
+  timed_out = FALSE;
+  g_array_set_size (arrivals, 0);
+
+  replay = g_build_filename (scratch, "replay", NULL);
+  metrics = g_build_filename (scratch, "github-notifyd.prom", NULL);
+  status = g_build_filename (scratch, "github-notifyd.status", NULL);
+
+  {
+    gchar *argv[] = { opt_daemon, "--no-daemon", "--poll-now", "--full-polling-interval", "0",
+                      "--idle-polling-interval", "0", "--ignore-dnd", "--no-user-avatar",
+                      "--replay", replay, "--replay-speed", "0",
+                      "--metrics-file", metrics, "--status-file", status, NULL };
+
+    if (!g_spawn_async (NULL, argv, envp, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &daemon_pid, &error))
+      {
+        fprintf (stderr, "cannot start %s: %s\n", opt_daemon, error->message);
+        g_error_free (error);
+        goto exit;
+      }
+  }
+
+  daemon_running = TRUE;
+  g_child_watch_add (daemon_pid, daemon_exited, NULL);
+
+  timeout_id = g_timeout_add_seconds (opt_timeout, burst_timeout, NULL);
+  while (daemon_running && !timed_out && (arrivals->len < (guint) opt_burst))
+    g_main_loop_run (mainloop);
+  if (!timed_out)
+    g_source_remove (timeout_id);
+
+  success = (arrivals->len >= (guint) opt_burst);
+
+  /* let the daemon shut down the way it does on Ctrl+C */
+  if (daemon_running)
+    {
+      kill (daemon_pid, SIGINT);
+
+      timed_out = FALSE;
+      timeout_id = g_timeout_add_seconds (opt_timeout, burst_timeout, NULL);
+      while (daemon_running && !timed_out)
+        g_main_loop_run (mainloop);
+      if (!timed_out)
+        g_source_remove (timeout_id);
+
+      if (daemon_running)
+        {
+          kill (daemon_pid, SIGKILL);
+          while (daemon_running)
+            g_main_loop_run (mainloop);
+        }
+    }
+
+exit:
+
+  g_free (replay);
+  g_free (metrics);
+  g_free (status);
+
+  return success;
+}
+
+
+/*
+ * time between two notifications reaching the server - the daemon's
+ * display cost plus the server latency
+ */
+static gint
+compare_gint64 (gconstpointer a,
+                gconstpointer b)
+{
+  gint64 x, y;
+
+  x = *(const gint64*) a;
+  y = *(const gint64*) b;
+
+  return (x > y) - (x < y);
+}
+
+static gdouble
+percentile_ms (GArray  *sorted,
+               guint    percentile)
+{
+  if (sorted->len == 0)
+    return 0;
+
+  return g_array_index (sorted, gint64, MIN ((sorted->len * percentile) / 100, sorted->len - 1)) / 1000.0;
+}
+
+static void
+collect_gaps (GArray  *gaps,
+              gint64  *elapsed,
+              guint   *count)
+{
+  gint64 gap;
+  guint i;
+
+  for (i = 1; i < arrivals->len; i++)
+    {
+      gap = g_array_index (arrivals, gint64, i) - g_array_index (arrivals, gint64, i - 1);
+      g_array_append_val (gaps, gap);
+    }
+
+  *count += arrivals->len;
+  if (arrivals->len > 1)
+    *elapsed += g_array_index (arrivals, gint64, arrivals->len - 1) - g_array_index (arrivals, gint64, 0);
+}
+
+static void
+print_results (GArray  *gaps,
+               gint64   elapsed,
+               guint    count)
+{
+  g_array_sort (gaps, compare_gint64);
+
+  printf ("%-6s %6u notifications %9.1f/s   gap p50 %7.2fms  p95 %7.2fms  p99 %7.2fms  max %7.2fms\n",
+          profile->id, count,
+          elapsed ? gaps->len * (gdouble) G_USEC_PER_SEC / elapsed : 0,
+          percentile_ms (gaps, 50), percentile_ms (gaps, 95), percentile_ms (gaps, 99),
+          percentile_ms (gaps, 100));
+  fflush (stdout);
+}
+
+
+/*
+ * main function
+ */
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *option_context;
+  GDBusNodeInfo *introspection_data;
+  GDBusConnection *connection;
+  GTestDBus *bus;
+  GError *error;
+  GArray *gaps;
+  gchar *scratch, *replay, **envp;
+  gint64 elapsed;
+  guint registration_id, owner_id, count, i;
+  gint burst, exit_value;
+
+  error = NULL;
+  bus = NULL;
+  connection = NULL;
+  introspection_data = NULL;
+  scratch = NULL;
+  envp = NULL;
+  registration_id = 0;
+  owner_id = 0;
+  exit_value = EXIT_SUCCESS;
+
+  option_context = g_option_context_new ("- display path benchmark of github-notifyd");
+  g_option_context_add_main_entries (option_context, entries, NULL);
+  if (!g_option_context_parse (option_context, &argc, &argv, &error))
+    {
+      fprintf (stderr, "option parsing failed: %s\n", error->message);
+      g_error_free (error);
+      exit_value = EXIT_FAILURE;
+      goto exit;
+    }
+
+  if ((opt_burst < 2) || (opt_bursts < 1))
+    {
+      fprintf (stderr, "a burst needs at least two notifications\n");
+      exit_value = EXIT_FAILURE;
+      goto exit;
+    }
+
+  if (!opt_daemon)
+    opt_daemon = g_strdup ("./github-notifyd");
+
+  mainloop = g_main_loop_new (NULL, FALSE);
+  arrivals = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  /* canned API traffic, caches of the daemon go here too */
+  scratch = g_dir_make_tmp ("github-notifyd-bench-XXXXXX", &error);
+  if (!scratch)
+    {
+      fprintf (stderr, "cannot create scratch directory: %s\n", error->message);
+      g_error_free (error);
+      exit_value = EXIT_FAILURE;
+      goto exit;
+    }
+
+  replay = g_build_filename (scratch, "replay", NULL);
+  if ((g_mkdir (replay, 0700) < 0) || !write_recordings (replay))
+    {
+      fprintf (stderr, "cannot write recorded traffic to %s\n", replay);
+      g_free (replay);
+      exit_value = EXIT_FAILURE;
+      goto exit;
+    }
+  g_free (replay);
+
+  envp = g_get_environ ();
+  envp = g_environ_setenv (envp, "XDG_CACHE_HOME", scratch, TRUE);
+
+  /* private session bus - the desktop's notification server stays untouched */
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (bus);
+  envp = g_environ_setenv (envp, "DBUS_SESSION_BUS_ADDRESS", g_test_dbus_get_bus_address (bus), TRUE);
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  if (!connection)
+    {
+      fprintf (stderr, "cannot connect to the private bus: %s\n", error->message);
+      g_error_free (error);
+      exit_value = EXIT_FAILURE;
+      goto exit;
+    }
+
+  introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+  registration_id = g_dbus_connection_register_object (connection, NOTIFICATIONS_PATH,
+                                                       introspection_data->interfaces[0],
+                                                       &interface_vtable, NULL, NULL, &error);
+  if (!registration_id)
+    {
+      fprintf (stderr, "cannot register the notification server: %s\n", error->message);
+      g_error_free (error);
+      exit_value = EXIT_FAILURE;
+      goto exit;
+    }
+
+  owner_id = g_bus_own_name_on_connection (connection, NOTIFICATIONS_NAME, G_BUS_NAME_OWNER_FLAGS_NONE,
+                                           on_name_acquired, NULL, NULL, NULL);
+  while (!name_acquired)
+    g_main_loop_run (mainloop);
+
+  for (i = 0; profiles [i].id; i++)
+    {
+      if (opt_vendor && g_strcmp0 (opt_vendor, profiles [i].id))
+        continue;
+
+      profile = &profiles [i];
+      gaps = g_array_new (FALSE, FALSE, sizeof (gint64));
+      elapsed = 0;
+      count = 0;
+
+      for (burst = 0; burst < opt_bursts; burst++)
+        {
+          if (!run_burst (scratch, envp))
+            {
+              fprintf (stderr, "%s: only %u of %d notifications arrived\n", profile->id, arrivals->len, opt_burst);
+              exit_value = EXIT_FAILURE;
+            }
+          collect_gaps (gaps, &elapsed, &count);
+        }
+
+      print_results (gaps, elapsed, count);
+      g_array_free (gaps, TRUE);
+    }
+
+  if (!profile)
+    {
+      fprintf (stderr, "unknown notification server '%s'\n", opt_vendor);
+      exit_value = EXIT_FAILURE;
+    }
+
+exit:
+
+  if (owner_id)
+    g_bus_unown_name (owner_id);
+  if (registration_id)
+    g_dbus_connection_unregister_object (connection, registration_id);
+  if (introspection_data)
+    g_dbus_node_info_unref (introspection_data);
+  if (connection)
+    g_object_unref (connection);
+  if (bus)
+    {
+      g_test_dbus_down (bus);
+      g_object_unref (bus);
+    }
+  if (scratch)
+    {
+      remove_tree (scratch);
+      g_free (scratch);
+    }
+  if (arrivals)
+    g_array_free (arrivals, TRUE);
+  if (mainloop)
+    g_main_loop_unref (mainloop);
+
+  g_strfreev (envp);
+  g_option_context_free (option_context);
+  g_free (opt_vendor);
+  g_free (opt_daemon);
+
+  return exit_value;
+}
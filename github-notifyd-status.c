@@ -0,0 +1,171 @@
+/* github-notifyd-status - print github-notifyd status for status bars
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "github-notifyd-status.h"
+
+
+/*
+ * map status file read-only
+ */
+static const struct github_notifyd_status *
+open_status (const char *path)
+{
+  void *map;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  map = mmap (NULL, sizeof (struct github_notifyd_status), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (map == MAP_FAILED)
+    return NULL;
+
+  return (const struct github_notifyd_status*) map;
+}
+
+
+/*
+ * print one snapshot
+ */
+static void
+print_status (const struct github_notifyd_status  *snapshot,
+              int                                  reasons,
+              int                                  verbose)
+{
+  int i;
+
+  if (!verbose && !reasons)
+    {
+      printf ("%u\n", snapshot->unread);
+      return;
+    }
+
+  if (verbose)
+    {
+      printf ("running: %s\n", snapshot->pid ? "yes" : "no");
+      printf ("unread: %u\n", snapshot->unread);
+      printf ("last_update: %lld\n", (long long) snapshot->last_update);
+      printf ("last_success: %lld\n", (long long) snapshot->last_success);
+      if (snapshot->last_error_time)
+        printf ("last_error: %lld %d %s\n", (long long) snapshot->last_error_time,
+                snapshot->last_error_code, snapshot->last_error);
+    }
+
+  for (i = 0; i < GITHUB_NOTIFYD_STATUS_REASONS; i++)
+    if (snapshot->reasons [i])
+      printf ("%s: %u\n", github_notifyd_status_reasons [i], snapshot->reasons [i]);
+}
+
+
+/*
+ * main function
+ */
+int
+main (int argc, char *argv[])
+{
+  const struct github_notifyd_status *shared;
+  struct github_notifyd_status snapshot;
+  const char *runtime_dir;
+  char *path;
+  uint32_t last_sequence;
+  int opt, reasons, verbose, follow;
+
+  memset (&snapshot, 0, sizeof (snapshot));
+  path = NULL;
+  reasons = 0;
+  verbose = 0;
+  follow = 0;
+
+  while ((opt = getopt (argc, argv, "f:rvw")) != -1)
+    {
+      switch (opt)
+        {
+          case 'f':
+            free (path);
+            path = strdup (optarg);
+            break;
+          case 'r':
+            reasons = 1;
+            break;
+          case 'v':
+            verbose = 1;
+            break;
+          case 'w':
+            follow = 1;
+            break;
+          default:
+            fprintf (stderr, "usage: %s [-f FILE] [-r] [-v] [-w]\n"
+                             "  -f FILE  status file [default: $XDG_RUNTIME_DIR/%s]\n"
+                             "  -r       unread count per reason\n"
+                             "  -v       all fields\n"
+                             "  -w       print again whenever the status changes\n",
+                     argv[0], GITHUB_NOTIFYD_STATUS_FILE);
+            return EXIT_FAILURE;
+        }
+    }
+
+  if (!path)
+    {
+      runtime_dir = getenv ("XDG_RUNTIME_DIR");
+      if (!runtime_dir || asprintf (&path, "%s/%s", runtime_dir, GITHUB_NOTIFYD_STATUS_FILE) < 0)
+        {
+          fprintf (stderr, "XDG_RUNTIME_DIR is not set\n");
+          return EXIT_FAILURE;
+        }
+    }
+
+  shared = open_status (path);
+  free (path);
+
+  /* status bars just show nothing when the daemon isn't there */
+  if (!shared)
+    return EXIT_FAILURE;
+
+  last_sequence = 0;
+  do
+    {
+      if ((github_notifyd_status_read (shared, &snapshot) == 0) &&
+          (snapshot.sequence != last_sequence))
+        {
+          if (!snapshot.pid && !verbose)
+            printf ("\n");
+          else
+            print_status (&snapshot, reasons, verbose);
+
+          fflush (stdout);
+          last_sequence = snapshot.sequence;
+        }
+    }
+  while (follow && (sleep (1) == 0));
+
+  munmap ((void*) shared, sizeof (struct github_notifyd_status));
+
+  return snapshot.pid ? EXIT_SUCCESS : EXIT_FAILURE;
+}
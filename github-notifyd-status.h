@@ -0,0 +1,96 @@
+/* github-notifyd - GitHub Notifications Daemon
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef GITHUB_NOTIFYD_STATUS_H
+#define GITHUB_NOTIFYD_STATUS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * status snapshot - a fixed-layout file in $XDG_RUNTIME_DIR which
+ * github-notifyd keeps memory-mapped and updates after every poll
+ */
+#define GITHUB_NOTIFYD_STATUS_FILE       "github-notifyd.status"
+#define GITHUB_NOTIFYD_STATUS_MAGIC      0x444e4847    /* 'GHND' */
+#define GITHUB_NOTIFYD_STATUS_VERSION    1
+#define GITHUB_NOTIFYD_STATUS_REASONS    16
+#define GITHUB_NOTIFYD_STATUS_ERROR_LEN  96
+#define GITHUB_NOTIFYD_STATUS_RETRIES    1000
+
+/* notification reasons, anything unknown is counted as "other" */
+static const char * const github_notifyd_status_reasons [GITHUB_NOTIFYD_STATUS_REASONS] =
+{
+  "assign", "author", "comment", "ci_activity", "invitation", "manual",
+  "mention", "review_requested", "security_alert", "state_change",
+  "subscribed", "team_mention", "approval_requested",
+  "member_feature_requested", "security_advisory_credit", "other"
+};
+
+struct github_notifyd_status
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sequence;                      /* odd while the daemon writes */
+  int32_t  pid;                           /* 0 - daemon is not running */
+  uint32_t unread;
+  int32_t  last_error_code;               /* HTTP code or negative pseudo code */
+  uint32_t reasons [GITHUB_NOTIFYD_STATUS_REASONS];
+  int64_t  last_update;                   /* unix time of the last poll cycle */
+  int64_t  last_success;                  /* unix time of the last successful poll */
+  int64_t  last_error_time;
+  char     last_error [GITHUB_NOTIFYD_STATUS_ERROR_LEN];
+};
+
+/*
+ * take a consistent copy of the shared snapshot - lock-free,
+ * the copy is retried while the daemon is in the middle of an update
+ */
+static inline int
+github_notifyd_status_read (const struct github_notifyd_status  *shared,
+                            struct github_notifyd_status        *snapshot)
+{
+  uint32_t begin, end;
+  int tries;
+
+  for (tries = 0; tries < GITHUB_NOTIFYD_STATUS_RETRIES; tries++)
+    {
+      begin = __atomic_load_n (&shared->sequence, __ATOMIC_ACQUIRE);
+      if (begin & 1)
+        continue;
+
+      memcpy (snapshot, shared, sizeof (*snapshot));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+      end = __atomic_load_n (&shared->sequence, __ATOMIC_RELAXED);
+      if (begin != end)
+        continue;
+
+      if ((snapshot->magic != GITHUB_NOTIFYD_STATUS_MAGIC) ||
+          (snapshot->version != GITHUB_NOTIFYD_STATUS_VERSION))
+        return -1;
+
+      snapshot->last_error [GITHUB_NOTIFYD_STATUS_ERROR_LEN - 1] = '\0';
+      return 0;
+    }
+
+  return -1;
+}
+
+#endif /* GITHUB_NOTIFYD_STATUS_H */
@@ -21,18 +21,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <time.h>
 #include <syslog.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #include <glib.h>
 #include <glib-unix.h>
+#include <gio/gio.h>
 #include <jansson.h>
 #include <curl/curl.h>
 #include <libnotify/notify.h>
 
+#include "github-notifyd-status.h"
+
 #ifdef HAVE_SYSTEMD
 #include <systemd/sd-journal.h>
+#include <systemd/sd-daemon.h>
+#endif
+
+/*
+ * static probes for bpftrace/perf - a single nop each when nothing is attached
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV (github_notifyd, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...) G_STMT_START { } G_STMT_END
+#endif
+
+#if !GLIB_CHECK_VERSION (2, 68, 0)
+#define g_memdup2(mem, size) g_memdup ((mem), (size))
 #endif
 
 #ifndef ACCESS_TOKEN
@@ -47,46 +70,528 @@
 #define USER_AGENT_HEADER            "User-Agent: github-notifyd/1.0"
 
 #define RESPONSE_CODE_OK             200
+#define RESPONSE_CODE_REDIRECTION    300
 #define RESPONSE_CODE_NOT_MODIFIED   304
 #define RESPONSE_CODE_UNAUTHORIZED   401
+#define RESPONSE_CODE_FORBIDDEN      403
+#define RESPONSE_CODE_NOT_FOUND      404
+#define RESPONSE_CODE_GONE           410
+#define RESPONSE_CODE_RATE_LIMITED   429
+#define RESPONSE_CODE_SERVER_ERROR   500
+#define RESPONSE_CODE_CIRCUIT_OPEN   -1
+#define RESPONSE_CODE_BACKOFF        -2
 #define GITHUB_API_NOTIFICATIONS     "https://api.github.com/notifications"
+#define GITHUB_API_PARTICIPATING     GITHUB_API_NOTIFICATIONS "?participating=true"
+#define MIN_POLLING_INTERVAL         45      /* sec */
+#define MACHINE_ID_FILE              "/etc/machine-id"
+#define DBUS_MACHINE_ID_FILE         "/var/lib/dbus/machine-id"
+#define GITHUB_API_RATE_LIMIT        "https://api.github.com/rate_limit"
+#define GITHUB_API_REPOS             "https://api.github.com/repos/"
+#define GITHUB_WEB                   "https://github.com/"
+#define GITHUB_API_THREADS           "https://api.github.com/notifications/threads/"
 #define SUMMARY                      "You have received a new GitHub Notification"
 
+#define DBUS_NAME                    "com.github.Notifyd"
+#define DBUS_PATH                    "/com/github/Notifyd"
+#define DBUS_INTERFACE               "com.github.Notifyd"
+#define DBUS_ERROR_NOT_FOUND         DBUS_INTERFACE ".Error.NotFound"
+#define DBUS_CALL_TIMEOUT            1000    /* ms */
+#define GNOME_NOTIFICATIONS_SCHEMA   "org.gnome.desktop.notifications"
+#define LOGIND_SESSION_PATH          "/org/freedesktop/login1/session/auto"
+
 #define BODY                         "body"
 #define BODY_HYPERLINKS              "body-hyperlinks"
 #define BODY_MARKUP                  "body-markup"
 #define PERSISTENCE                  "persistence"
+#define ACTIONS                      "actions"
+#define ACTION_OPEN                  "open"
+#define ACTION_MARK_READ             "mark-read"
+#define ACTION_MARK_REPO_READ        "mark-repo-read"
+#define ACTION_DETAILS               "details"
+#define AVATAR_DIR                   "avatars"
+#define AVATAR_INDEX_FILE            "index"
+#define AVATAR_LEGACY_DIR            "/tmp"
+#define AVATAR_LEGACY_DONE           "legacy-removed"
+#define SLO_MAX                      8
+#define SLO_THRESHOLDS               "60,300"
+#define EAGER_REASONS                "mention,team_mention,review_requested,assign"
+#define MARK_READ_DELAY              2       /* sec */
+#define ACTIONS_MAX                  100     /* popups kept for their actions */
+#define ACTIONS_LIFETIME             3600    /* sec */
+#define WATCH_PER_PAGE               10
+#define WATCH_MIN_INTERVAL           60      /* sec */
+#define WATCH_BUCKET_SIZE            2
+#define WATCH_MAX_POPUPS             3
+#define TRACE_ROTATIONS              3
+#define TRACE_TID_MAIN               1
+#define STAGE_DEPTH                  16
+#define WATCHDOG_TICK                1000    /* ms */
+#define RECORD_REDACTED              "REDACTED"
 
 #define TAG_BOLD                     "<b>"
 #define TAG_BOLD_END                 "</b>"
 
+#define METRICS_FILE                 "github-notifyd.prom"
+#define DUMP_FILE                    "github-notifyd.dump"
+#define REQUEST_TIMEOUT              30L
+#define MULTI_WAIT_TIMEOUT           50      /* ms */
+#define LATENCY_SAMPLES              128
+#define HEDGE_MIN_SAMPLES            20
+#define HEDGE_DEFAULT_THRESHOLD      1000    /* ms */
+#define HEDGE_MIN_THRESHOLD          250     /* ms */
+#define BREAKER_MAX_COOLDOWN         600     /* s */
+#define DNS_CACHE_TIMEOUT            300L    /* s */
+#define RATE_LIMIT_DEFAULT_BACKOFF   60      /* s */
+#define NEGATIVE_CACHE_MAX           1024
+#define IDLE_BACKLOG_MAX             200
+#define DND_QUEUE_MAX                200
+#define STORE_MAX                    1000
+#define FEED_MAX_PAGES               (STORE_MAX / 50)    /* 50 threads per page */
+#define DIGEST_MAX_LINES             10
+#define NEGATIVE_TTL_NOT_FOUND       21600   /* s */
+#define NEGATIVE_TTL_FORBIDDEN       900     /* s */
+#define NEGATIVE_TTL_INVALID         3600    /* s */
+#define NEGATIVE_TTL_SERVER_ERROR    60      /* s */
+#define AIMD_INITIAL_WINDOW          2.0
+#define AIMD_DECREASE                0.5
+#define AIMD_LATENCY_FACTOR          2.0
+#define AIMD_LATENCY_GAIN            0.2
+#define AIMD_BASE_LATENCY_GAIN       0.01
+
 static gboolean opt_no_daemon = FALSE;
 static gboolean opt_no_avatar = FALSE;
 static gboolean opt_persistent = FALSE;
+static gboolean opt_poll_now = FALSE;
+static gboolean opt_quit = FALSE;
 static guint opt_interval = 45;
+static guint opt_full_interval = 300;
+static gboolean opt_no_phase = FALSE;
+static guint opt_idle_interval = 600;
+static guint opt_connect_timeout = 10000;
+static guint opt_tls_timeout = 10000;
+static guint opt_first_byte_timeout = 15000;
+static guint opt_low_speed_limit = 32;
+static guint opt_low_speed_time = 15;
+static gboolean opt_hedge = FALSE;
+static gboolean opt_prewarm = FALSE;
+static guint opt_prewarm_lead = 5;
+static guint opt_max_concurrency = 8;
+static gboolean opt_lazy = FALSE;
+static gchar *opt_eager_reasons = NULL;
+static gchar **eager_reasons = NULL;
+static gchar *opt_slo_thresholds = NULL;
+static guint slo_thresholds[SLO_MAX];
+static guint slo_count = 0;
+static guint opt_breaker_threshold = 3;
+static guint opt_breaker_cooldown = 30;
+static guint opt_cache_size = 4096;
+static gboolean opt_ignore_dnd = FALSE;
+static guint opt_dnd_queue_size = 256;
+static gchar **opt_watch_repos = NULL;
+static guint opt_watch_interval = 300;
+static gchar *opt_metrics_file = NULL;
+static gchar *opt_status_file = NULL;
+static gchar *opt_trace_file = NULL;
+static guint opt_trace_size = 10240;
+static guint opt_stall_threshold = 2000;
+static gchar *opt_record_dir = NULL;
+static gchar *opt_replay_dir = NULL;
+static gdouble opt_replay_speed = 1.0;
 
 static GMainLoop *mainloop;
 static gchar *name, *vendor;
 static gchar *version, *spec_version;
 static glong last_mod = 0;
+static gchar *next_page = NULL;
+static CURLM *multi;
+static CURLSH *share;
+static GHashTable *shown_threads = NULL;
+static GHashTable *hosts;
+static GList *deferred_notifications = NULL;
+static GHashTable *http_cache = NULL;
+static gsize http_cache_size = 0;
+static GHashTable *negative_cache = NULL;
+static GDBusProxy *logind_session = NULL;
+static guint screensaver_watch = 0;
+static gboolean screensaver_active = FALSE;
+static gboolean user_idle = FALSE;
+static gboolean catch_up = FALSE;
+static GList *idle_backlog = NULL;
+static GSettings *gnome_notifications = NULL;
+static GDBusProxy *notification_server = NULL;
+static gboolean dnd_active = FALSE;
+static GList *dnd_queue = NULL;
+static GHashTable *store = NULL;
+static GDBusConnection *service_bus = NULL;
+static struct github_notifyd_status *status_map = NULL;
+static gint64 poll_success = 0;
+static gint64 poll_error_time = 0;
+static glong poll_error_code = 0;
+static const gchar *poll_error = NULL;
+static GHashTable *mark_read_threads = NULL;
+static GHashTable *mark_read_repos = NULL;
+static guint mark_read_source = 0;
+static GQueue action_popups = G_QUEUE_INIT;
+static guint http_in_flight = 0;
+static gint dump_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t dump_requested = 0;
+static const gchar *stages[STAGE_DEPTH];
+static guint stage_depth = 0;
+static const gchar *loop_stage = NULL;
+static gint64 loop_heartbeat = 0;
+static gint64 loop_progress = 0;
+static guint64 watchdog_usec = 0;
+static GThread *watchdog = NULL;
+static GMutex watchdog_mutex;
+static GCond watchdog_cond;
+static gboolean watchdog_stop = FALSE;
+static guint record_seq = 0;
+static gint64 replay_clock = 0;
+static GHashTable *replay_index = NULL;
+static GList *replay_pending = NULL;
+static GString *trace_buffer = NULL;
+static GQueue trace_stack = G_QUEUE_INIT;
+static guint64 trace_next_id = 1;
+static GPtrArray *watched_repos = NULL;
+static GHashTable *avatar_index = NULL;
+static gchar *avatar_dir = NULL;
+static gboolean avatar_index_dirty = FALSE;
+static guint watch_source = 0;
+static guint watch_next = 0;
+
+static struct
+{
+  gdouble  tokens;
+  gint64   refilled;
+} watch_bucket;
 
-typedef struct
+typedef struct notification
 {
   gchar  *repository;
   gchar  *repository_url;
+  gchar  *repository_api_url;
+  gchar  *html_url;
   gchar  *type;
   gchar  *title;
   gchar  *user;
   gchar  *user_avatar;
   gchar  *reason;
+  gchar  *id;
+  gchar  *updated_at;
+  gchar  *comment_url;
+  gchar  *avatar_url;
+  guint32 user_id;
+  gint64  updated;       /* thread update on GitHub [us] */
+  gint64  polled;        /* poll request started */
+  gint64  fetched;       /* notifications list received */
+  gint64  enriched;
+  struct http_transfer *transfer;
 } notification;
 
+typedef struct
+{
+  gchar  *id;
+  gchar  *repository;
+  gchar  *type;
+  gchar  *title;
+  gchar  *reason;
+  gchar  *url;
+  gchar  *api_url;
+  gchar  *updated_at;
+} store_entry;
+
+typedef struct
+{
+  gchar  *id;
+  gchar  *repository;    /* API url */
+  gchar  *url;           /* opened in the browser */
+  gint64  shown;
+  struct notification *lazy;
+} thread_actions;
+
+typedef struct
+{
+  gchar    *name;          /* OWNER/REPO */
+  gchar    *url;           /* events feed */
+  gchar    *etag;
+  gchar    *last_event;    /* newest event already seen */
+  gboolean  primed;
+  gboolean  disabled;
+} watched_repo;
+
+typedef struct
+{
+  gchar  *url;
+  gchar  *hash;          /* SHA-256 of the image and its extension */
+} avatar_entry;
+
+/*
+ * poll lanes - participating threads are polled often,
+ * the complete feed less frequently
+ */
+typedef struct
+{
+  const gchar  *name;
+  const gchar  *url;
+  guint        *interval;
+  gboolean      full;            /* complete list of unread threads */
+  gboolean      enabled;
+  glong         last_mod;        /* validator of the previous response */
+  guint         source;
+  guint         prewarm_source;
+  gint64        next;
+  guint64       phase;           /* stable per machine, user and lane */
+  guint64       polls;
+  gboolean      catch_up;        /* not polled since the user came back */
+} poll_lane;
+
+enum {
+  LANE_PARTICIPATING = 0,
+  LANE_ALL,
+  LANES
+};
+
+static poll_lane lanes [LANES] =
+{
+  { "participating", GITHUB_API_PARTICIPATING, &opt_interval, FALSE, TRUE },
+  { "all", GITHUB_API_NOTIFICATIONS, &opt_full_interval, TRUE, TRUE }
+};
+
 struct data_struct
 {
   gchar  *data;
   gsize   size;
 };
 
+typedef enum
+{
+  PHASE_CONNECT = 0,
+  PHASE_TLS,
+  PHASE_FIRST_BYTE,
+  PHASE_TRANSFER,
+  PHASE_LAST
+} transfer_phase;
+
+static const gchar *breaker_names[] =
+{
+  "closed",
+  "open",
+  "half_open"
+};
+
+static const gchar *phase_names[] =
+{
+  "connect",
+  "tls",
+  "first_byte",
+  "transfer"
+};
+
+typedef enum
+{
+  BREAKER_CLOSED = 0,
+  BREAKER_OPEN,
+  BREAKER_HALF_OPEN
+} breaker_state;
+
+typedef enum
+{
+  BUS_NAME_PENDING = 0,
+  BUS_NAME_OWNED,
+  BUS_NAME_TAKEN,
+  BUS_NAME_LOST
+} bus_name_result;
+
+static bus_name_result bus_name_state = BUS_NAME_PENDING;
+static guint bus_name_id = 0;
+
+typedef struct
+{
+  gchar          *name;
+  breaker_state   breaker;
+  guint           failures;
+  guint           cooldown;
+  gint64          open_until;
+  guint64         short_circuited;
+  guint64         trips;
+  guint64         connections_new;
+  guint64         connections_reused;
+  gint64          backoff_until;
+  guint64         rate_limited;
+  guint64         deferred;
+  gint64          ratelimit_remaining;
+  gint64          ratelimit_reset;
+} host_state;
+
+typedef struct
+{
+  gchar   *url;
+  gchar   *data;
+  gsize    size;
+  gchar   *etag;
+  gchar   *last_modified;
+  gint64   expires;
+  gint64   used;
+} cache_entry;
+
+typedef struct
+{
+  glong    code;
+  gint64   expires;
+} negative_entry;
+
+/* HTTP exchange loaded from a --record directory */
+typedef struct
+{
+  glong      code;
+  CURLcode   status;
+  gint64     first_byte;      /* us after the start */
+  gint64     duration;        /* us */
+  gint64     time;            /* unix time of the recording, 0 - unknown */
+  gchar     *headers;
+  gchar     *body;
+  gsize      size;
+} recorded_exchange;
+
+typedef struct http_transfer
+{
+  gchar              *url;
+  host_state         *host;
+  CURL               *curl;
+  struct curl_slist  *headers;
+  struct data_struct  chunk;
+  gboolean            api_request;
+  gboolean            pass_ifmodsince;
+  gint64              started;
+  gint64              first_byte;
+  gboolean            done;
+  gboolean            short_circuited;
+  gboolean            deferred;
+  gboolean            rate_limited;
+  gboolean            reused;
+  CURLcode            status;
+  glong               code;
+  guint               retry_after;
+  gint64              ratelimit_remaining;
+  gint64              ratelimit_reset;
+  gboolean            cacheable;
+  gboolean            from_cache;
+  gboolean            negative_hit;
+  gboolean            no_store;
+  gboolean            no_cache;
+  gint64              max_age;
+  gint64              age;
+  gchar              *etag;
+  gchar              *last_modified;
+  gchar              *next_page;
+  guint64             trace_id;
+  guint64             trace_parent;
+  const gchar        *method;
+  GString            *raw_headers;
+  recorded_exchange  *replay;
+  gint64              replay_due;
+} http_transfer;
+
+
+/*
+ * time-to-notify - from the thread update on GitHub to the popup
+ */
+enum {
+  TTN_WAIT = 0,          /* update until the poll started */
+  TTN_FETCH,             /* notifications list request */
+  TTN_ENRICH,            /* comment author and avatar */
+  TTN_DELIVER,           /* D-Bus call to the notification server */
+  TTN_TOTAL,
+  TTN_LAST
+};
+
+static const gchar *ttn_stages[] = { "wait", "fetch", "enrich", "deliver", "total" };
+
+/* histogram buckets [s] - time to notify and main loop lag */
+#define HISTOGRAM_BUCKETS            12
+static const gdouble ttn_buckets[HISTOGRAM_BUCKETS] = { 0.1, 0.5, 1, 5, 15, 30, 60, 120, 300, 600, 1800, 3600 };
+static const gdouble lag_buckets[HISTOGRAM_BUCKETS] = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 10 };
+
+typedef struct
+{
+  const gdouble *bounds;
+  guint64  buckets[HISTOGRAM_BUCKETS];
+  guint64  count;
+  gdouble  sum;
+} histogram;
+
+/* open span of the trace, nested spans are kept on a stack */
+typedef struct
+{
+  guint64       id;
+  guint64       parent;
+  const gchar  *name;
+  const gchar  *category;
+  gint64        start;
+} trace_span;
+
+
+/*
+ * daemon statistics, exported to the metrics file
+ */
+static struct
+{
+  guint64  requests;
+  guint64  timeouts[PHASE_LAST];
+  guint64  hedges_sent;
+  guint64  hedges_won;
+  guint64  prewarms;
+  guint64  prewarms_reused;
+  guint64  polls_warm;
+  guint64  polls_cold;
+  guint64  cache_hits;
+  guint64  cache_stale;
+  guint64  cache_misses;
+  guint64  cache_evictions;
+  guint64  negative_hits;
+  guint64  negative_inserts;
+  guint64  idle_polls;
+  guint64  catch_up_digests;
+  guint64  dnd_dropped;
+  guint64  dnd_digests;
+  guint64  store_changes;
+  guint64  store_dropped;
+  guint64  marked_read;
+  guint64  mark_read_errors;
+  guint64  watch_requests;
+  guint64  watch_not_modified;
+  guint64  watch_events;
+  guint64  duplicates;
+  guint64  lazy_skipped;
+  guint64  lazy_enrichments;
+  guint64  avatar_writes;
+  guint64  avatar_dedup;
+  histogram ttn[TTN_LAST];
+  guint64  slo_met[SLO_MAX];
+  guint64  slo_missed[SLO_MAX];
+  histogram loop_lag;
+  guint64  loop_stalls;            /* updated by the watchdog thread */
+} stats;
+
+static struct
+{
+  guint  samples[LATENCY_SAMPLES];
+  guint  count;
+  guint  next;
+} first_byte_latency;
+
+static struct
+{
+  gdouble  window;
+  gdouble  latency;
+  gdouble  base_latency;
+  gint64   last_decrease;
+  gint64   hold_until;
+  guint    max_in_flight;
+  guint64  increases;
+  guint64  decreases;
+} concurrency = { AIMD_INITIAL_WINDOW };
+
 
 /*
  * notification server caps
@@ -96,7 +601,8 @@ enum {
   CAP_BODY = 0,
   CAP_BODY_HYPERLINKS,
   CAP_BODY_MARKUP,
-  CAP_PERSISTENCE
+  CAP_PERSISTENCE,
+  CAP_ACTIONS
 };
 
 static gboolean server_caps[] =
@@ -104,10 +610,42 @@ static gboolean server_caps[] =
   FALSE, /* body            */
   FALSE, /* body-hyperlinks */
   FALSE, /* body-markup     */
-  FALSE  /* persistence     */
+  FALSE, /* persistence     */
+  FALSE  /* actions         */
 };
 
 
+/*
+ * D-Bus introspection data
+ */
+static const gchar introspection_xml[] =
+  "<node>"
+  "  <interface name='" DBUS_INTERFACE "'>"
+  "    <method name='PollNow'/>"
+  "    <method name='Quit'/>"
+  "    <method name='GetUnreadCount'>"
+  "      <arg type='u' name='count' direction='out'/>"
+  "    </method>"
+  "    <method name='GetCountsByReason'>"
+  "      <arg type='a{su}' name='counts' direction='out'/>"
+  "    </method>"
+  "    <method name='GetCountsByRepository'>"
+  "      <arg type='a{su}' name='counts' direction='out'/>"
+  "    </method>"
+  "    <method name='List'>"
+  "      <arg type='aa{sv}' name='notifications' direction='out'/>"
+  "    </method>"
+  "    <method name='Get'>"
+  "      <arg type='s' name='id' direction='in'/>"
+  "      <arg type='a{sv}' name='notification' direction='out'/>"
+  "    </method>"
+  "    <signal name='Changed'>"
+  "      <arg type='u' name='unread'/>"
+  "    </signal>"
+  "  </interface>"
+  "</node>";
+
+
 /*
  * commandline options
  */
@@ -116,7 +654,39 @@ GOptionEntry entries[] =
   { "no-daemon", 'n', 0, G_OPTION_ARG_NONE, &opt_no_daemon, "Don't detach github-notifyd into the background", NULL},
   { "no-user-avatar", 'a', 0, G_OPTION_ARG_NONE, &opt_no_avatar, "Don't show user avatar as a notification icon", NULL},
   { "persistent-notifications", 'p', 0, G_OPTION_ARG_NONE, &opt_persistent, "Use persistent notifications", NULL},
+  { "poll-now", 0, 0, G_OPTION_ARG_NONE, &opt_poll_now, "Poll immediately, or ask the running instance to do so", NULL},
+  { "quit", 'q', 0, G_OPTION_ARG_NONE, &opt_quit, "Ask the running instance to quit", NULL},
   { "polling-interval", 'i', 0, G_OPTION_ARG_INT, &opt_interval, "Notifications polling interval [default: 45s]", NULL},
+  { "full-polling-interval", 0, 0, G_OPTION_ARG_INT, &opt_full_interval, "Polling interval of threads you don't participate in, 0 polls everything with --polling-interval [default: 300s]", "SECONDS"},
+  { "no-poll-phase", 0, 0, G_OPTION_ARG_NONE, &opt_no_phase, "Don't spread polls of this host within the interval", NULL},
+  { "idle-polling-interval", 0, 0, G_OPTION_ARG_INT, &opt_idle_interval, "Polling interval while the user is away, 0 disables idle detection [default: 600s]", "SECONDS"},
+  { "connect-timeout", 0, 0, G_OPTION_ARG_INT, &opt_connect_timeout, "TCP connect timeout [default: 10000ms]", "MS"},
+  { "tls-timeout", 0, 0, G_OPTION_ARG_INT, &opt_tls_timeout, "TLS handshake timeout [default: 10000ms]", "MS"},
+  { "first-byte-timeout", 0, 0, G_OPTION_ARG_INT, &opt_first_byte_timeout, "Time to first response byte [default: 15000ms]", "MS"},
+  { "low-speed-limit", 0, 0, G_OPTION_ARG_INT, &opt_low_speed_limit, "Abort transfers slower than this [default: 32B/s]", "BYTES"},
+  { "low-speed-time", 0, 0, G_OPTION_ARG_INT, &opt_low_speed_time, "...for this long [default: 15s]", "SECONDS"},
+  { "hedge-requests", 0, 0, G_OPTION_ARG_NONE, &opt_hedge, "Duplicate slow requests on a fresh connection", NULL},
+  { "prewarm", 0, 0, G_OPTION_ARG_NONE, &opt_prewarm, "Open or verify the API connection shortly before each poll", NULL},
+  { "prewarm-lead", 0, 0, G_OPTION_ARG_INT, &opt_prewarm_lead, "How long before the poll to pre-warm [default: 5s]", "SECONDS"},
+  { "lazy-enrichment", 0, 0, G_OPTION_ARG_NONE, &opt_lazy, "Fetch comment author and avatar only on request or for important threads", NULL},
+  { "eager-reasons", 0, 0, G_OPTION_ARG_STRING, &opt_eager_reasons, "Reasons enriched up front with --lazy-enrichment [default: " EAGER_REASONS "]", "LIST"},
+  { "max-concurrency", 0, 0, G_OPTION_ARG_INT, &opt_max_concurrency, "Upper limit of concurrent enrichment requests [default: 8]", "N"},
+  { "breaker-threshold", 0, 0, G_OPTION_ARG_INT, &opt_breaker_threshold, "Consecutive failures that open a host's circuit [default: 3]", "N"},
+  { "breaker-cooldown", 0, 0, G_OPTION_ARG_INT, &opt_breaker_cooldown, "Time an open circuit waits before probing [default: 30s]", "SECONDS"},
+  { "cache-size", 0, 0, G_OPTION_ARG_INT, &opt_cache_size, "HTTP cache size, 0 disables caching [default: 4096KiB]", "KIB"},
+  { "ignore-dnd", 0, 0, G_OPTION_ARG_NONE, &opt_ignore_dnd, "Show notifications in do-not-disturb mode too", NULL},
+  { "dnd-queue-size", 0, 0, G_OPTION_ARG_INT, &opt_dnd_queue_size, "Memory for notifications queued in do-not-disturb mode [default: 256KiB]", "KIB"},
+  { "watch-repo", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_watch_repos, "Show releases and pushes of a repository, may be repeated", "OWNER/REPO"},
+  { "watch-interval", 0, 0, G_OPTION_ARG_INT, &opt_watch_interval, "How often each watched repository is checked [default: 300s]", "SECONDS"},
+  { "slo-thresholds", 0, 0, G_OPTION_ARG_STRING, &opt_slo_thresholds, "Time-to-notify objectives, at most 8 [default: " SLO_THRESHOLDS "]", "SECONDS,..."},
+  { "metrics-file", 0, 0, G_OPTION_ARG_FILENAME, &opt_metrics_file, "Metrics file [default: $XDG_RUNTIME_DIR/github-notifyd.prom]", "FILE"},
+  { "status-file", 0, 0, G_OPTION_ARG_FILENAME, &opt_status_file, "Status snapshot for status bars [default: $XDG_RUNTIME_DIR/github-notifyd.status]", "FILE"},
+  { "trace-file", 0, 0, G_OPTION_ARG_FILENAME, &opt_trace_file, "Record poll cycles in Chrome trace-event format (Perfetto, chrome://tracing)", "FILE"},
+  { "trace-size", 0, 0, G_OPTION_ARG_INT, &opt_trace_size, "Size at which the trace file is rotated [default: 10240KiB]", "KIB"},
+  { "record", 0, 0, G_OPTION_ARG_FILENAME, &opt_record_dir, "Record all HTTP exchanges to a directory, the token is redacted", "DIR"},
+  { "replay", 0, 0, G_OPTION_ARG_FILENAME, &opt_replay_dir, "Serve HTTP exchanges recorded with --record instead of the network", "DIR"},
+  { "replay-speed", 0, 0, G_OPTION_ARG_DOUBLE, &opt_replay_speed, "Replay speed-up of responses and polls, 0 - no delays [default: 1.0]", "FACTOR"},
+  { "stall-threshold", 0, 0, G_OPTION_ARG_INT, &opt_stall_threshold, "Log main loop stalls longer than this, 0 disables [default: 2000ms]", "MS"},
   { NULL }
 };
 
@@ -208,6 +778,9 @@ set_server_caps (gpointer data,
 
   if (!g_strcmp0 (PERSISTENCE, (gchar*) data))
     server_caps[CAP_PERSISTENCE] = TRUE;
+
+  if (!g_strcmp0 (ACTIONS, (gchar*) data))
+    server_caps[CAP_ACTIONS] = TRUE;
 }
 
 
@@ -241,507 +814,5628 @@ write_callback (void   *ptr,
 
 
 /*
- * curl request
+ * value of 'name' header or NULL if the line is another header
  */
 static gchar *
-curl_request (const gchar  *url,
-              gboolean      pass_ifmodsince,
-              glong        *code)
+header_value (const gchar  *buffer,
+              gsize         length,
+              const gchar  *name)
 {
-  CURL *curl;
-  CURLcode status;
-  struct curl_slist *headers;
-  struct data_struct chunk;
+  gsize name_length;
 
-  headers = NULL;
-
-  /* init buffer for incoming data */
-  chunk.data = malloc(1);
-  chunk.size = 0;
+  name_length = strlen (name);
+  if ((length <= name_length) || (buffer[name_length] != ':') ||
+      g_ascii_strncasecmp (buffer, name, name_length))
+    return NULL;
 
-  /* init the curl session */
-  curl_global_init(CURL_GLOBAL_ALL);
-  curl = curl_easy_init();
-  if (!curl)
-    {
-      print_log (LOG_ERR, "curl_easy_init() failed\n");
-      goto exit_null;
-    }
+  return g_strstrip (g_strndup (buffer + name_length + 1, length - name_length - 1));
+}
 
-  /* set 'url' to use in the request */
-  curl_easy_setopt(curl, CURLOPT_URL, url);
 
-  /* GitHub API v3 requires a 'User-Agent' header */
-  headers = curl_slist_append (headers, USER_AGENT_HEADER);
+/*
+ * header callback - the first header line marks the first byte
+ */
+static size_t
+header_callback (char   *buffer,
+                 gsize   size,
+                 gsize   nitems,
+                 void   *userdata)
+{
+  http_transfer *transfer;
+  gsize length;
+  gchar *value;
+  time_t date;
 
-  /* set personal access token */
-  headers = curl_slist_append (headers, ACCESS_TOKEN_HEADER);
+  transfer = (http_transfer*) userdata;
+  length = size * nitems;
 
-  /* set custom HTTP headers */
-  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+  if (transfer->raw_headers)
+    g_string_append_len (transfer->raw_headers, buffer, length);
 
-  /* set callback for writing received data */
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  if (!transfer->first_byte)
+    transfer->first_byte = g_get_monotonic_time ();
 
-  /* pass 'data_struct' to the callback function */
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &chunk);
+  /* 'Retry-After' is either a delay in seconds or a HTTP date */
+  if ((value = header_value (buffer, length, "Retry-After")))
+    {
+      if (g_ascii_isdigit (value[0]))
+        transfer->retry_after = (guint) g_ascii_strtoull (value, NULL, 10);
+      else if ((date = curl_getdate (value, NULL)) > time (NULL))
+        transfer->retry_after = (guint) (date - time (NULL));
 
-  /* maximum time the request is allowed to take - 30s */
-  curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+      g_free (value);
+    }
 
-  /* set 'If-Modified-Since' value */
-  if (pass_ifmodsince)
+  /* freshness lifetime and validators */
+  if ((value = header_value (buffer, length, "Cache-Control")))
     {
-      curl_easy_setopt(curl, CURLOPT_FILETIME, 1);
-      curl_easy_setopt(curl, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
-      curl_easy_setopt(curl, CURLOPT_TIMEVALUE, last_mod);
+      gchar **directives;
+      guint i;
+
+      directives = g_strsplit (value, ",", -1);
+      for (i = 0; directives[i]; i++)
+        {
+          g_strstrip (directives[i]);
+          if (g_str_has_prefix (directives[i], "max-age="))
+            transfer->max_age = g_ascii_strtoll (directives[i] + 8, NULL, 10);
+          else if (!g_strcmp0 (directives[i], "no-store"))
+            transfer->no_store = TRUE;
+          else if (!g_strcmp0 (directives[i], "no-cache"))
+            transfer->no_cache = TRUE;
+        }
+
+      g_strfreev (directives);
+      g_free (value);
     }
 
-  /* perform a blocking request */
-  status = curl_easy_perform (curl);
-  if (status != CURLE_OK)
+  if ((value = header_value (buffer, length, "Age")))
     {
-      print_log (LOG_ERR, "curl_easy_perform() failed: %s\n", curl_easy_strerror(status));
-      goto exit_null;
+      transfer->age = g_ascii_strtoll (value, NULL, 10);
+      g_free (value);
     }
 
-  /* check response code */
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, code);
-  if((*code != RESPONSE_CODE_OK) && (*code != RESPONSE_CODE_NOT_MODIFIED))
+  if ((value = header_value (buffer, length, "ETag")))
     {
-      print_log (LOG_ERR, "curl request error: server responded with code %ld\n", *code);
-      goto exit_null;
+      g_free (transfer->etag);
+      transfer->etag = value;
     }
 
-  /* read 'Last-Modified' value */
-  if (pass_ifmodsince)
+  if ((value = header_value (buffer, length, "Last-Modified")))
     {
-      if (*code != RESPONSE_CODE_NOT_MODIFIED)
-        curl_easy_getinfo(curl, CURLINFO_FILETIME, &last_mod);
-      else
-        goto exit_null;
+      g_free (transfer->last_modified);
+      transfer->last_modified = value;
     }
 
-  /* clean up curl stuff */
-  curl_easy_cleanup (curl);
-  curl_slist_free_all (headers);
-  curl_global_cleanup();
+  /* pagination - the cache doesn't keep headers, so paged responses aren't stored */
+  if ((value = header_value (buffer, length, "Link")))
+    {
+      gchar **links, *end;
+      guint i;
 
-  /* return received data */
-  return chunk.data;
+      links = g_strsplit (value, ",", -1);
+      for (i = 0; links[i]; i++)
+        {
+          g_strstrip (links[i]);
+          if ((links[i][0] != '<') || !strstr (links[i], "rel=\"next\"") ||
+              !(end = strchr (links[i], '>')))
+            continue;
 
-exit_null:
+          g_free (transfer->next_page);
+          transfer->next_page = g_strndup (links[i] + 1, end - links[i] - 1);
+        }
 
-  if (chunk.data)
-    free (chunk.data);
-  if (curl)
-    curl_easy_cleanup(curl);
-  if (headers)
-    curl_slist_free_all (headers);
+      transfer->no_store = TRUE;
+      g_strfreev (links);
+      g_free (value);
+    }
 
-  curl_global_cleanup();
-  return NULL;
+  /* primary rate limit budget */
+  if ((value = header_value (buffer, length, "X-RateLimit-Remaining")))
+    {
+      transfer->ratelimit_remaining = g_ascii_strtoll (value, NULL, 10);
+      g_free (value);
+    }
+
+  if ((value = header_value (buffer, length, "X-RateLimit-Reset")))
+    {
+      transfer->ratelimit_reset = g_ascii_strtoll (value, NULL, 10);
+      g_free (value);
+    }
+
+  return length;
 }
 
 
 /*
- * download user avatar
+ * write metrics in the Prometheus text format
  */
-static gchar *
-prepare_avatar (guint32       id,
-                const gchar  *avatar_url)
+static void
+metrics_type (GString      *metrics,
+              const gchar  *name,
+              const gchar  *type)
 {
-  FILE *fp;
-  CURL *curl;
-  CURLcode status;
-  gchar *path;
-
-  fp = NULL;
-  curl = NULL;
-  path = NULL;
-
-  /* prepare string containing an absolute path to image - /tmp/ID.png */
-  if ((asprintf (&path, "/tmp/%d.png", id) == -1))
-    return NULL;
+  g_string_append_printf (metrics, "# TYPE github_notifyd_%s %s\n", name, type);
+}
 
-  /* check whether a file exists */
-  if (access (path, F_OK) == -1)
-    {
-      print_log (LOG_INFO, "downloading user avatar image\n");
-      fp = fopen(path, "w");
+static void
+metrics_counter (GString      *metrics,
+                 const gchar  *name,
+                 const gchar  *labels,
+                 guint64       value)
+{
+  g_string_append_printf (metrics, "github_notifyd_%s%s%s%s %" G_GUINT64_FORMAT "\n",
+                          name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "", value);
+}
 
-      /* init the curl session */
-      curl = curl_easy_init();
-      if (curl)
-        {
-          /* use internal default function instead of callback */
-          curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, NULL);
+static void
+metrics_gauge (GString      *metrics,
+               const gchar  *name,
+               const gchar  *labels,
+               gdouble       value)
+{
+  g_string_append_printf (metrics, "github_notifyd_%s%s%s%s %.3f\n",
+                          name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "", value);
+}
 
-          /* write the data directly to file descriptor */
-          curl_easy_setopt (curl, CURLOPT_WRITEDATA, fp);
-          curl_easy_setopt (curl, CURLOPT_URL, avatar_url);
+static void
+metrics_histogram (GString      *metrics,
+                   const gchar  *name,
+                   const gchar  *labels,
+                   histogram    *h)
+{
+  const gchar *separator;
+  guint64 cumulative;
+  guint i;
 
-          /* perform a blocking request */
-          status = curl_easy_perform (curl);
-          if (status != CURLE_OK)
-            {
-              print_log (LOG_ERR, "curl_easy_perform() failed: %s\n", curl_easy_strerror(status));
-              goto error;
-            }
-        }
-      else
-        goto error;
+  separator = labels ? "," : "";
+  labels = labels ? labels : "";
 
-      /* some clean up */
-      fclose (fp);
-      curl_easy_cleanup (curl);
+  cumulative = 0;
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      cumulative += h->buckets[i];
+      g_string_append_printf (metrics, "github_notifyd_%s_bucket{%s%sle=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                              name, labels, separator, h->bounds[i], cumulative);
     }
 
-  return path;
-
-error:
+  g_string_append_printf (metrics, "github_notifyd_%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                          name, labels, separator, h->count);
+  g_string_append_printf (metrics, "github_notifyd_%s_sum{%s} %.3f\n", name, labels, h->sum);
+  g_string_append_printf (metrics, "github_notifyd_%s_count{%s} %" G_GUINT64_FORMAT "\n", name, labels, h->count);
+}
 
-  /* upss... something goes wrong */
-  print_log (LOG_ERR, "cannot prepare user avatar image\n");
+static void
+histogram_observe (histogram  *h,
+                   gdouble     value)
+{
+  guint i;
 
-  if (fp)
-    fclose (fp);
-  if (curl)
-    curl_easy_cleanup (curl);
-  if (path)
-    free (path);
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    if (value <= h->bounds[i])
+      {
+        h->buckets[i]++;
+        break;
+      }
 
-  return NULL;
+  h->count++;
+  h->sum += value;
 }
 
 
 /*
- * show notification
+ * record time-to-notify of a shown notification, split into stages -
+ * waiting behind earlier popups of the batch is in neither enrich nor deliver
  */
 static void
-show_notification (gpointer data,
-                   gpointer user_data)
+record_time_to_notify (notification  *notif,
+                       gint64         delivering,
+                       gint64         shown)
 {
-  NotifyNotification *notif_to_show;
-  GString *body;
-  gchar *newline, *bold, *bold_end;
-  notification *notif;
+  gint64 stages[TTN_LAST];
+  gdouble total;
+  guint i;
 
-  notif = (notification*) data;
-  body = g_string_new (NULL);
-  newline = "\n";
-  bold = TAG_BOLD;
-  bold_end = TAG_BOLD_END;
+  /* update time unknown - clock skew is clamped below */
+  if (!notif->updated || !notif->polled)
+    return;
 
-  /*
-   * notification servers that do not support body tags should
-   * filter them out, but to be sure let's remove them from body
-   */
-  if (!server_caps[CAP_BODY_MARKUP])
-    {
-      bold = "";
-      bold_end = "";
-    }
+  stages[TTN_WAIT] = MAX (0, notif->polled - notif->updated);
+  stages[TTN_FETCH] = notif->fetched - notif->polled;
+  stages[TTN_ENRICH] = notif->enriched - notif->fetched;
+  stages[TTN_DELIVER] = shown - delivering;
+  stages[TTN_TOTAL] = MAX (0, shown - notif->updated);
 
-  /*
-   * Exception 1: notification server on KDE (version 1.0)
-   * doesn't understand '\n' - we have to replace it with <br\>
-   */
-  if ((g_strcmp0 (name, "Plasma") == 0) &&
-      (g_strcmp0 (vendor, "KDE") == 0) &&
-      (g_strcmp0 (version, "1.0") == 0))
-    {
-      newline = "<br/>";
-    }
+  for (i = 0; i < TTN_LAST; i++)
+    histogram_observe (&stats.ttn[i], (gdouble) stages[i] / G_USEC_PER_SEC);
 
-  /*
-   * Exception 2: xfce4-notifyd notification server for Xfce,
-   * doesn't support properly hyperlinks in the notifications
-   */
-  if ((g_strcmp0 (name, "Xfce Notify Daemon") == 0) &&
-      (g_strcmp0 (vendor, "Xfce") == 0))
+  total = (gdouble) stages[TTN_TOTAL] / G_USEC_PER_SEC;
+  for (i = 0; i < slo_count; i++)
     {
-      server_caps [CAP_BODY_HYPERLINKS] = FALSE;
+      if (total <= slo_thresholds[i])
+        stats.slo_met[i]++;
+      else
+        stats.slo_missed[i]++;
     }
+}
 
-  /*
-   * some notification servers implementations may only show the summary,
-   * if server supports body text, let's append it to the notification
-   */
-  if (server_caps [CAP_BODY])
-    {
-      g_string_append_printf (body, "%sRepository:%s\t %s%s", bold, bold_end, notif->repository, newline);
-      g_string_append_printf (body, "%sType:%s\t\t %s%s", bold, bold_end, notif->type, newline);
-      g_string_append_printf (body, "%sTitle:%s\t\t %s%s", bold, bold_end, notif->title, newline);
-      g_string_append_printf (body, "%sUser:%s\t\t %s", bold, bold_end, notif->user);
 
-      /* check whether server supports hyperlinks in the notifications */
-      if (server_caps [CAP_BODY_HYPERLINKS])
-        {
-          g_string_append_printf (body, "%s%sLink:%s\t\t <a href=%s>Link to Repository</a>",
-                                  newline, bold, bold_end, notif->repository_url);
-        }
-    }
+/*
+ * tracing - spans of the poll cycle in Chrome trace-event format,
+ * buffered during the cycle and appended to the trace file after it
+ */
+static json_t *
+trace_event_new (const gchar  *phase,
+                 const gchar  *name,
+                 const gchar  *category,
+                 gint64        ts,
+                 guint64       id,
+                 guint64       parent,
+                 const gchar  *detail)
+{
+  json_t *event, *args;
 
-  /* create new notification */
-  notif_to_show = notify_notification_new (SUMMARY, body->str, notif->user_avatar);
+  event = json_pack ("{s:s, s:s, s:s, s:I, s:i, s:i}",
+                     "name", name, "cat", category, "ph", phase, "ts", (json_int_t) ts,
+                     "pid", (gint) getpid (), "tid", TRACE_TID_MAIN);
 
-  /* persistent/transient */
-  if (!opt_persistent)
-    notify_notification_set_hint (notif_to_show, "transient", g_variant_new_boolean (TRUE));
-  else
-    if (!server_caps [CAP_PERSISTENCE])
-      print_log (LOG_INFO, "notification server doesn't support persistent notifications\n");
+  args = json_pack ("{s:I, s:I}", "span", (json_int_t) id, "parent", (json_int_t) parent);
+  if (detail)
+    json_object_set_new (args, "detail", json_string (detail));
+  json_object_set_new (event, "args", args);
 
-  /* timeout and urgency */
-  notify_notification_set_timeout (notif_to_show, NOTIFY_EXPIRES_DEFAULT);
-  notify_notification_set_urgency (notif_to_show, NOTIFY_URGENCY_NORMAL);
+  return event;
+}
 
-  /* finally we can show notification */
-  notify_notification_show (notif_to_show, NULL);
+static void
+trace_append (json_t *event)
+{
+  gchar *line;
 
-  /* it's time to clean up */
-  g_string_free (body, TRUE);
-  g_object_unref (G_OBJECT(notif_to_show));
+  line = json_dumps (event, JSON_COMPACT);
+  if (line)
+    {
+      g_string_append (trace_buffer, line);
+      g_string_append (trace_buffer, ",\n");
+      free (line);
+    }
+
+  json_decref (event);
 }
 
+static guint64
+trace_current (void)
+{
+  trace_span *span;
 
-/*
+  span = (trace_span*) g_queue_peek_head (&trace_stack);
+  return span ? span->id : 0;
+}
+
+static trace_span *
+trace_begin (const gchar  *name,
+             const gchar  *category)
+{
+  trace_span *span;
+
+  /* the watchdog names the stage that stalled the loop */
+  if (stage_depth < STAGE_DEPTH)
+    stages[stage_depth] = name;
+  stage_depth++;
+  __atomic_store_n (&loop_stage, name, __ATOMIC_RELEASE);
+
+  if (!trace_buffer)
+    return NULL;
+
+  span = g_new0 (trace_span, 1);
+  span->id = trace_next_id++;
+  span->parent = trace_current ();
+  span->name = name;
+  span->category = category;
+  span->start = g_get_monotonic_time ();
+
+  g_queue_push_head (&trace_stack, span);
+  return span;
+}
+
+static void
+trace_end (trace_span   *span,
+           const gchar  *detail)
+{
+  json_t *event;
+
+  stage_depth--;
+  __atomic_store_n (&loop_stage, stage_depth ? stages[MIN (stage_depth, STAGE_DEPTH) - 1] : NULL, __ATOMIC_RELEASE);
+
+  if (!span)
+    return;
+
+  g_queue_remove (&trace_stack, span);
+
+  /* complete event - nested spans of the main loop thread */
+  event = trace_event_new ("X", span->name, span->category, span->start,
+                           span->id, span->parent, detail);
+  json_object_set_new (event, "dur", json_integer (g_get_monotonic_time () - span->start));
+  trace_append (event);
+
+  g_free (span);
+}
+
+/*
+ * transfers run concurrently in the multi handle - async events
+ * get their own track for every overlapping transfer
+ */
+static void
+trace_transfer (const gchar  *url,
+                gint64        started,
+                guint64       id,
+                guint64       parent,
+                glong         code)
+{
+  json_t *event;
+  gchar *async_id;
+
+  if (!trace_buffer || !id)
+    return;
+
+  async_id = g_strdup_printf ("0x%" G_GINT64_MODIFIER "x", id);
+
+  event = trace_event_new ("b", "transfer", "http", started, id, parent, url);
+  json_object_set_new (event, "id", json_string (async_id));
+  trace_append (event);
+
+  event = trace_event_new ("e", "transfer", "http", g_get_monotonic_time (), id, parent, NULL);
+  json_object_set_new (event, "id", json_string (async_id));
+  json_object_set_new (json_object_get (event, "args"), "code", json_integer (code));
+  trace_append (event);
+
+  g_free (async_id);
+}
+
+static void
+trace_flush (void)
+{
+  struct stat st;
+  gchar *from, *to;
+  gboolean empty;
+  FILE *file;
+  gint i;
+
+  if (!trace_buffer || !trace_buffer->len)
+    return;
+
+  empty = (stat (opt_trace_file, &st) != 0) || (st.st_size == 0);
+
+  /* rotate - FILE.1 is the most recent of the old traces */
+  if (!empty && opt_trace_size && ((gsize) st.st_size + trace_buffer->len > (gsize) opt_trace_size * 1024))
+    {
+      for (i = TRACE_ROTATIONS - 1; i > 0; i--)
+        {
+          from = g_strdup_printf ("%s.%d", opt_trace_file, i);
+          to = g_strdup_printf ("%s.%d", opt_trace_file, i + 1);
+          rename (from, to);
+          g_free (from);
+          g_free (to);
+        }
+
+      to = g_strdup_printf ("%s.1", opt_trace_file);
+      rename (opt_trace_file, to);
+      g_free (to);
+      empty = TRUE;
+    }
+
+  file = fopen (opt_trace_file, "a");
+  if (!file)
+    {
+      print_log (LOG_ERR, "cannot write trace file %s\n", opt_trace_file);
+      g_string_truncate (trace_buffer, 0);
+      return;
+    }
+
+  /*
+   * the closing bracket is optional in the JSON array format,
+   * so every file - rotated ones too - can be loaded on its own
+   */
+  if (empty)
+    fprintf (file, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"github-notifyd\"}},\n",
+             (gint) getpid (), TRACE_TID_MAIN);
+
+  fwrite (trace_buffer->str, 1, trace_buffer->len, file);
+  fclose (file);
+
+  g_string_truncate (trace_buffer, 0);
+}
+
+
+/*
+ * first byte latency percentile [ms]
+ */
+static gint
+compare_guint (gconstpointer a,
+               gconstpointer b)
+{
+  guint x, y;
+
+  x = *(const guint*) a;
+  y = *(const guint*) b;
+
+  return (x > y) - (x < y);
+}
+
+static guint
+first_byte_percentile (guint percentile)
+{
+  guint sorted[LATENCY_SAMPLES];
+
+  if (first_byte_latency.count == 0)
+    return 0;
+
+  memcpy (sorted, first_byte_latency.samples, first_byte_latency.count * sizeof (guint));
+  qsort (sorted, first_byte_latency.count, sizeof (guint), compare_guint);
+
+  return sorted[(first_byte_latency.count * percentile) / 100];
+}
+
+static guint
+hedge_threshold (void)
+{
+  /* we don't know the latency distribution yet */
+  if (first_byte_latency.count < HEDGE_MIN_SAMPLES)
+    return HEDGE_DEFAULT_THRESHOLD;
+
+  return MAX (first_byte_percentile (95), HEDGE_MIN_THRESHOLD);
+}
+
+
+static guint host_backoff_remaining (host_state *host);
+
+/*
+ * counter family with a sample per host, kept
+ * together as the text format requires
+ */
+static void
+metrics_host_counter (GString      *metrics,
+                      const gchar  *name,
+                      glong         offset)
+{
+  GHashTableIter iter;
+  host_state *host;
+  gpointer value;
+  gchar *labels;
+
+  metrics_type (metrics, name, "counter");
+
+  g_hash_table_iter_init (&iter, hosts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      host = (host_state*) value;
+      labels = g_strdup_printf ("host=\"%s\"", host->name);
+      metrics_counter (metrics, name, labels, G_STRUCT_MEMBER (guint64, host, offset));
+      g_free (labels);
+    }
+}
+
+/*
+ * write metrics file
+ */
+static void
+metrics_write (void)
+{
+  GHashTableIter iter;
+  GString *metrics;
+  GError *error;
+  host_state *host;
+  gpointer value;
+  trace_span *span;
+  gchar *labels;
+  guint64 lookups;
+  guint phase, i;
+
+  if (!opt_metrics_file)
+    return;
+
+  span = trace_begin ("metrics_write", "flush");
+  metrics = g_string_new (NULL);
+  error = NULL;
+
+  metrics_type (metrics, "http_requests_total", "counter");
+  metrics_counter (metrics, "http_requests_total", NULL, stats.requests);
+
+  metrics_type (metrics, "http_timeouts_total", "counter");
+  for (phase = 0; phase < PHASE_LAST; phase++)
+    {
+      labels = g_strdup_printf ("phase=\"%s\"", phase_names[phase]);
+      metrics_counter (metrics, "http_timeouts_total", labels, stats.timeouts[phase]);
+      g_free (labels);
+    }
+
+  metrics_type (metrics, "http_first_byte_p95_ms", "gauge");
+  metrics_gauge (metrics, "http_first_byte_p95_ms", NULL, first_byte_percentile (95));
+
+  metrics_type (metrics, "hedge_requests_total", "counter");
+  metrics_counter (metrics, "hedge_requests_total", NULL, stats.hedges_sent);
+
+  metrics_type (metrics, "hedge_wins_total", "counter");
+  metrics_counter (metrics, "hedge_wins_total", NULL, stats.hedges_won);
+
+  metrics_type (metrics, "hedge_threshold_ms", "gauge");
+  metrics_gauge (metrics, "hedge_threshold_ms", NULL, hedge_threshold ());
+
+  metrics_type (metrics, "http_cache_requests_total", "counter");
+  metrics_counter (metrics, "http_cache_requests_total", "result=\"hit\"", stats.cache_hits);
+  metrics_counter (metrics, "http_cache_requests_total", "result=\"stale\"", stats.cache_stale);
+  metrics_counter (metrics, "http_cache_requests_total", "result=\"miss\"", stats.cache_misses);
+
+  lookups = stats.cache_hits + stats.cache_stale + stats.cache_misses;
+  metrics_type (metrics, "http_cache_ratio", "gauge");
+  metrics_gauge (metrics, "http_cache_ratio", "result=\"hit\"", lookups ? (gdouble) stats.cache_hits / lookups : 0);
+  metrics_gauge (metrics, "http_cache_ratio", "result=\"stale\"", lookups ? (gdouble) stats.cache_stale / lookups : 0);
+  metrics_gauge (metrics, "http_cache_ratio", "result=\"miss\"", lookups ? (gdouble) stats.cache_misses / lookups : 0);
+
+  metrics_type (metrics, "http_cache_entries", "gauge");
+  metrics_gauge (metrics, "http_cache_entries", NULL, http_cache ? g_hash_table_size (http_cache) : 0);
+
+  metrics_type (metrics, "http_cache_bytes", "gauge");
+  metrics_gauge (metrics, "http_cache_bytes", NULL, http_cache_size);
+
+  metrics_type (metrics, "http_cache_evictions_total", "counter");
+  metrics_counter (metrics, "http_cache_evictions_total", NULL, stats.cache_evictions);
+
+  metrics_type (metrics, "negative_cache_hits_total", "counter");
+  metrics_counter (metrics, "negative_cache_hits_total", NULL, stats.negative_hits);
+
+  metrics_type (metrics, "negative_cache_inserts_total", "counter");
+  metrics_counter (metrics, "negative_cache_inserts_total", NULL, stats.negative_inserts);
+
+  metrics_type (metrics, "negative_cache_entries", "gauge");
+  metrics_gauge (metrics, "negative_cache_entries", NULL, g_hash_table_size (negative_cache));
+
+  metrics_type (metrics, "user_idle", "gauge");
+  metrics_gauge (metrics, "user_idle", NULL, user_idle);
+
+  metrics_type (metrics, "idle_polls_total", "counter");
+  metrics_counter (metrics, "idle_polls_total", NULL, stats.idle_polls);
+
+  metrics_type (metrics, "idle_backlog", "gauge");
+  metrics_gauge (metrics, "idle_backlog", NULL, g_list_length (idle_backlog));
+
+  metrics_type (metrics, "catch_up_digests_total", "counter");
+  metrics_counter (metrics, "catch_up_digests_total", NULL, stats.catch_up_digests);
+
+  metrics_type (metrics, "dnd_active", "gauge");
+  metrics_gauge (metrics, "dnd_active", NULL, dnd_active);
+
+  metrics_type (metrics, "dnd_queue", "gauge");
+  metrics_gauge (metrics, "dnd_queue", NULL, g_list_length (dnd_queue));
+
+  metrics_type (metrics, "dnd_dropped_total", "counter");
+  metrics_counter (metrics, "dnd_dropped_total", NULL, stats.dnd_dropped);
+
+  metrics_type (metrics, "dnd_digests_total", "counter");
+  metrics_counter (metrics, "dnd_digests_total", NULL, stats.dnd_digests);
+
+  metrics_type (metrics, "store_notifications", "gauge");
+  metrics_gauge (metrics, "store_notifications", NULL, g_hash_table_size (store));
+
+  metrics_type (metrics, "store_changes_total", "counter");
+  metrics_counter (metrics, "store_changes_total", NULL, stats.store_changes);
+
+  metrics_type (metrics, "store_dropped_total", "counter");
+  metrics_counter (metrics, "store_dropped_total", NULL, stats.store_dropped);
+
+  metrics_type (metrics, "marked_read_total", "counter");
+  metrics_counter (metrics, "marked_read_total", NULL, stats.marked_read);
+
+  metrics_type (metrics, "mark_read_errors_total", "counter");
+  metrics_counter (metrics, "mark_read_errors_total", NULL, stats.mark_read_errors);
+
+  metrics_type (metrics, "watched_repositories", "gauge");
+  metrics_gauge (metrics, "watched_repositories", NULL, watched_repos ? watched_repos->len : 0);
+
+  metrics_type (metrics, "watch_requests_total", "counter");
+  metrics_counter (metrics, "watch_requests_total", NULL, stats.watch_requests);
+
+  metrics_type (metrics, "watch_not_modified_total", "counter");
+  metrics_counter (metrics, "watch_not_modified_total", NULL, stats.watch_not_modified);
+
+  metrics_type (metrics, "watch_events_total", "counter");
+  metrics_counter (metrics, "watch_events_total", NULL, stats.watch_events);
+
+  metrics_type (metrics, "polls_total", "counter");
+  for (i = 0; i < LANES; i++)
+    {
+      if (!lanes [i].enabled)
+        continue;
+
+      labels = g_strdup_printf ("lane=\"%s\"", lanes [i].name);
+      metrics_counter (metrics, "polls_total", labels, lanes [i].polls);
+      g_free (labels);
+    }
+
+  metrics_type (metrics, "duplicate_threads_total", "counter");
+  metrics_counter (metrics, "duplicate_threads_total", NULL, stats.duplicates);
+
+  metrics_type (metrics, "lazy_enrichment_total", "counter");
+  metrics_counter (metrics, "lazy_enrichment_total", "result=\"skipped\"", stats.lazy_skipped);
+  metrics_counter (metrics, "lazy_enrichment_total", "result=\"requested\"", stats.lazy_enrichments);
+
+  metrics_type (metrics, "avatar_users", "gauge");
+  metrics_gauge (metrics, "avatar_users", NULL, avatar_index ? g_hash_table_size (avatar_index) : 0);
+
+  metrics_type (metrics, "avatar_stores_total", "counter");
+  metrics_counter (metrics, "avatar_stores_total", "result=\"written\"", stats.avatar_writes);
+  metrics_counter (metrics, "avatar_stores_total", "result=\"deduplicated\"", stats.avatar_dedup);
+
+  metrics_type (metrics, "time_to_notify_seconds", "histogram");
+  for (i = 0; i < TTN_LAST; i++)
+    {
+      labels = g_strdup_printf ("stage=\"%s\"", ttn_stages[i]);
+      metrics_histogram (metrics, "time_to_notify_seconds", labels, &stats.ttn[i]);
+      g_free (labels);
+    }
+
+  metrics_type (metrics, "time_to_notify_slo_total", "counter");
+  for (i = 0; i < slo_count; i++)
+    {
+      labels = g_strdup_printf ("threshold=\"%u\",result=\"met\"", slo_thresholds[i]);
+      metrics_counter (metrics, "time_to_notify_slo_total", labels, stats.slo_met[i]);
+      g_free (labels);
+
+      labels = g_strdup_printf ("threshold=\"%u\",result=\"missed\"", slo_thresholds[i]);
+      metrics_counter (metrics, "time_to_notify_slo_total", labels, stats.slo_missed[i]);
+      g_free (labels);
+    }
+
+  metrics_type (metrics, "loop_lag_seconds", "histogram");
+  metrics_histogram (metrics, "loop_lag_seconds", NULL, &stats.loop_lag);
+
+  metrics_type (metrics, "loop_stalls_total", "counter");
+  metrics_counter (metrics, "loop_stalls_total", NULL, __atomic_load_n (&stats.loop_stalls, __ATOMIC_RELAXED));
+
+  metrics_type (metrics, "concurrency_window", "gauge");
+  metrics_gauge (metrics, "concurrency_window", NULL, concurrency.window);
+
+  metrics_type (metrics, "concurrency_latency_ms", "gauge");
+  metrics_gauge (metrics, "concurrency_latency_ms", "kind=\"smoothed\"", concurrency.latency);
+  metrics_gauge (metrics, "concurrency_latency_ms", "kind=\"base\"", concurrency.base_latency);
+
+  metrics_type (metrics, "concurrency_max_in_flight", "gauge");
+  metrics_gauge (metrics, "concurrency_max_in_flight", NULL, concurrency.max_in_flight);
+
+  metrics_type (metrics, "concurrency_adjustments_total", "counter");
+  metrics_counter (metrics, "concurrency_adjustments_total", "direction=\"increase\"", concurrency.increases);
+  metrics_counter (metrics, "concurrency_adjustments_total", "direction=\"decrease\"", concurrency.decreases);
+
+  metrics_type (metrics, "circuit_state", "gauge");
+  g_hash_table_iter_init (&iter, hosts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      host = (host_state*) value;
+      for (i = 0; i < G_N_ELEMENTS (breaker_names); i++)
+        {
+          labels = g_strdup_printf ("host=\"%s\",state=\"%s\"", host->name, breaker_names[i]);
+          metrics_gauge (metrics, "circuit_state", labels, host->breaker == i);
+          g_free (labels);
+        }
+    }
+
+  metrics_host_counter (metrics, "circuit_trips_total", G_STRUCT_OFFSET (host_state, trips));
+  metrics_host_counter (metrics, "circuit_short_circuited_total", G_STRUCT_OFFSET (host_state, short_circuited));
+  metrics_host_counter (metrics, "connections_new_total", G_STRUCT_OFFSET (host_state, connections_new));
+  metrics_host_counter (metrics, "connections_reused_total", G_STRUCT_OFFSET (host_state, connections_reused));
+  metrics_host_counter (metrics, "rate_limited_total", G_STRUCT_OFFSET (host_state, rate_limited));
+  metrics_host_counter (metrics, "deferred_requests_total", G_STRUCT_OFFSET (host_state, deferred));
+
+  metrics_type (metrics, "backoff_remaining_seconds", "gauge");
+  g_hash_table_iter_init (&iter, hosts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      host = (host_state*) value;
+      labels = g_strdup_printf ("host=\"%s\"", host->name);
+      metrics_gauge (metrics, "backoff_remaining_seconds", labels, host_backoff_remaining (host));
+      g_free (labels);
+    }
+
+  metrics_type (metrics, "ratelimit_remaining", "gauge");
+  g_hash_table_iter_init (&iter, hosts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      host = (host_state*) value;
+      if (host->ratelimit_remaining < 0)
+        continue;
+
+      labels = g_strdup_printf ("host=\"%s\"", host->name);
+      metrics_gauge (metrics, "ratelimit_remaining", labels, host->ratelimit_remaining);
+      g_free (labels);
+    }
+
+  metrics_type (metrics, "prewarm_total", "counter");
+  metrics_counter (metrics, "prewarm_total", NULL, stats.prewarms);
+
+  metrics_type (metrics, "prewarm_reused_total", "counter");
+  metrics_counter (metrics, "prewarm_reused_total", NULL, stats.prewarms_reused);
+
+  metrics_type (metrics, "poll_connections_total", "counter");
+  metrics_counter (metrics, "poll_connections_total", "connection=\"warm\"", stats.polls_warm);
+  metrics_counter (metrics, "poll_connections_total", "connection=\"cold\"", stats.polls_cold);
+
+  metrics_type (metrics, "poll_warm_ratio", "gauge");
+  metrics_gauge (metrics, "poll_warm_ratio", NULL, (stats.polls_warm + stats.polls_cold) ?
+                 (gdouble) stats.polls_warm / (stats.polls_warm + stats.polls_cold) : 0);
+
+  if (!g_file_set_contents (opt_metrics_file, metrics->str, metrics->len, &error))
+    {
+      print_log (LOG_ERR, "cannot write metrics file: %s\n", error->message);
+      g_error_free (error);
+    }
+
+  g_string_free (metrics, TRUE);
+  trace_end (span, NULL);
+}
+
+
+/*
+ * per-host state
+ */
+static void
+host_state_free (gpointer data)
+{
+  host_state *host;
+  host = (host_state*) data;
+
+  g_free (host->name);
+  g_free (host);
+}
+
+static host_state *
+host_lookup (const gchar *url)
+{
+  host_state *host;
+  const gchar *start;
+  gchar *name;
+
+  /* 'scheme://host[:port]/path' */
+  start = strstr (url, "://");
+  start = start ? start + 3 : url;
+  name = g_strndup (start, strcspn (start, "/:?#"));
+
+  host = g_hash_table_lookup (hosts, name);
+  if (host)
+    {
+      g_free (name);
+      return host;
+    }
+
+  host = g_new0 (host_state, 1);
+  host->name = name;
+  host->breaker = BREAKER_CLOSED;
+  host->cooldown = opt_breaker_cooldown;
+  host->ratelimit_remaining = -1;
+  g_hash_table_insert (hosts, host->name, host);
+
+  return host;
+}
+
+
+/*
+ * circuit breaker - open after consecutive failures, let a single
+ * probe through after the cooldown and close again once it succeeds
+ */
+static gboolean
+host_allow_request (host_state *host)
+{
+  switch (host->breaker)
+    {
+      case BREAKER_CLOSED:
+        return TRUE;
+
+      case BREAKER_OPEN:
+        if (g_get_monotonic_time () >= host->open_until)
+          {
+            print_log (LOG_INFO, "circuit half-open, probing host %s\n", host->name);
+            host->breaker = BREAKER_HALF_OPEN;
+            return TRUE;
+          }
+        break;
+
+      default:
+        break;
+    }
+
+  host->short_circuited++;
+  return FALSE;
+}
+
+static void
+host_record_result (host_state  *host,
+                    gboolean     success)
+{
+  if (success)
+    {
+      if (host->breaker != BREAKER_CLOSED)
+        print_log (LOG_INFO, "circuit closed, host %s is back\n", host->name);
+
+      host->breaker = BREAKER_CLOSED;
+      host->failures = 0;
+      host->cooldown = opt_breaker_cooldown;
+      return;
+    }
+
+  host->failures++;
+
+  /* failed probe - stay open for twice as long */
+  if (host->breaker == BREAKER_HALF_OPEN)
+    host->cooldown = MIN (host->cooldown * 2, BREAKER_MAX_COOLDOWN);
+  else if (host->failures < opt_breaker_threshold)
+    return;
+
+  print_log (LOG_ERR, "circuit open for %us after %u consecutive failures - host %s\n",
+             host->cooldown, host->failures, host->name);
+
+  host->breaker = BREAKER_OPEN;
+  host->open_until = g_get_monotonic_time () + (gint64) host->cooldown * G_USEC_PER_SEC;
+  host->trips++;
+}
+
+
+/*
+ * rate limiting - 429, or 403 with 'Retry-After' or exhausted budget,
+ * pauses all requests to the host until the deadline passes
+ */
+static guint
+host_backoff_remaining (host_state *host)
+{
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  if (host->backoff_until <= now)
+    return 0;
+
+  return (guint) ((host->backoff_until - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC);
+}
+
+static void
+host_record_rate_limit (host_state     *host,
+                        http_transfer  *transfer)
+{
+  gint64 delay, now;
+
+  if (transfer->ratelimit_remaining >= 0)
+    {
+      host->ratelimit_remaining = transfer->ratelimit_remaining;
+      host->ratelimit_reset = transfer->ratelimit_reset;
+    }
+
+  if ((transfer->code != RESPONSE_CODE_RATE_LIMITED) &&
+      ((transfer->code != RESPONSE_CODE_FORBIDDEN) ||
+       ((transfer->retry_after == 0) && (transfer->ratelimit_remaining != 0))))
+    return;
+
+  transfer->rate_limited = TRUE;
+  host->rate_limited++;
+
+  /* 'Retry-After' first, then the budget reset time, at least one minute otherwise */
+  if (transfer->retry_after > 0)
+    delay = transfer->retry_after;
+  else if ((transfer->ratelimit_remaining == 0) && (transfer->ratelimit_reset > time (NULL)))
+    delay = transfer->ratelimit_reset - time (NULL);
+  else
+    delay = RATE_LIMIT_DEFAULT_BACKOFF;
+
+  now = g_get_monotonic_time ();
+  if (now + delay * G_USEC_PER_SEC <= host->backoff_until)
+    return;
+
+  /* log it only once - requests in flight will hit the same limit */
+  if (host->backoff_until <= now)
+    print_log (LOG_WARNING, "rate limited by %s (code=%ld) - pausing requests for %" G_GINT64_FORMAT "s\n",
+               host->name, transfer->code, delay);
+
+  host->backoff_until = now + delay * G_USEC_PER_SEC;
+}
+
+
+/*
+ * HTTP freshness cache - responses are kept for their 'max-age'
+ * and served without touching the network, stale ones are revalidated
+ */
+static void
+cache_entry_free (gpointer data)
+{
+  cache_entry *entry;
+  entry = (cache_entry*) data;
+
+  http_cache_size -= entry->size;
+
+  g_free (entry->url);
+  g_free (entry->data);
+  g_free (entry->etag);
+  g_free (entry->last_modified);
+  g_free (entry);
+}
+
+static cache_entry *
+http_cache_lookup (const gchar *url)
+{
+  cache_entry *entry;
+
+  if (!http_cache)
+    return NULL;
+
+  entry = g_hash_table_lookup (http_cache, url);
+  if (entry)
+    entry->used = g_get_monotonic_time ();
+
+  return entry;
+}
+
+static gboolean
+http_cache_fresh (cache_entry *entry)
+{
+  return entry && (g_get_monotonic_time () < entry->expires);
+}
+
+static void
+http_cache_evict (void)
+{
+  GHashTableIter iter;
+  cache_entry *entry, *oldest;
+  gpointer value;
+
+  /* least recently used entries go first */
+  while (http_cache_size > (gsize) opt_cache_size * 1024)
+    {
+      oldest = NULL;
+
+      g_hash_table_iter_init (&iter, http_cache);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          entry = (cache_entry*) value;
+          if (!oldest || (entry->used < oldest->used))
+            oldest = entry;
+        }
+
+      if (!oldest)
+        break;
+
+      g_hash_table_remove (http_cache, oldest->url);
+      stats.cache_evictions++;
+    }
+}
+
+/* fill the transfer with cached response */
+static void
+http_cache_serve (http_transfer  *transfer,
+                  cache_entry    *entry)
+{
+  transfer->from_cache = TRUE;
+  transfer->done = TRUE;
+  transfer->status = CURLE_OK;
+
+  /* conditional requests have seen this response already */
+  if (transfer->pass_ifmodsince)
+    {
+      transfer->code = RESPONSE_CODE_NOT_MODIFIED;
+      return;
+    }
+
+  transfer->code = RESPONSE_CODE_OK;
+
+  free (transfer->chunk.data);
+  transfer->chunk.data = malloc (entry->size + 1);
+  transfer->chunk.size = entry->size;
+  memcpy (transfer->chunk.data, entry->data, entry->size);
+  transfer->chunk.data[entry->size] = 0;
+}
+
+/* store or refresh cached response */
+static void
+http_cache_update (http_transfer *transfer)
+{
+  cache_entry *entry;
+  gint64 now, lifetime;
+
+  if (!http_cache || !transfer->cacheable || transfer->no_store)
+    return;
+
+  now = g_get_monotonic_time ();
+  /* 'no-cache' wins over 'max-age' - always revalidate */
+  lifetime = transfer->no_cache ? 0 : MAX (transfer->max_age - transfer->age, 0);
+  entry = http_cache_lookup (transfer->url);
+
+  if (transfer->code == RESPONSE_CODE_NOT_MODIFIED)
+    {
+      if (!entry)
+        return;
+
+      entry->expires = now + lifetime * G_USEC_PER_SEC;
+
+      /* revalidated - use cached body */
+      if (!transfer->pass_ifmodsince)
+        {
+          http_cache_serve (transfer, entry);
+          transfer->from_cache = FALSE;
+        }
+      return;
+    }
+
+  if (transfer->code != RESPONSE_CODE_OK)
+    return;
+
+  /* nothing to revalidate with and no freshness lifetime */
+  if (!transfer->etag && !transfer->last_modified && (lifetime == 0))
+    return;
+
+  entry = g_new0 (cache_entry, 1);
+  entry->url = g_strdup (transfer->url);
+  entry->etag = g_strdup (transfer->etag);
+  entry->last_modified = g_strdup (transfer->last_modified);
+  entry->expires = now + lifetime * G_USEC_PER_SEC;
+  entry->used = now;
+
+  /* bodies of conditional requests are never served again */
+  if (!transfer->pass_ifmodsince)
+    {
+      entry->data = g_memdup2 (transfer->chunk.data, transfer->chunk.size);
+      entry->size = transfer->chunk.size;
+    }
+
+  http_cache_size += entry->size;
+  g_hash_table_replace (http_cache, entry->url, entry);
+  http_cache_evict ();
+}
+
+
+/*
+ * negative cache - known-bad enrichment targets aren't requested
+ * again until the status-specific TTL expires
+ */
+static gboolean
+negative_entry_expired (gpointer key,
+                        gpointer value,
+                        gpointer user_data)
+{
+  return ((negative_entry*) value)->expires <= *(gint64*) user_data;
+}
+
+static negative_entry *
+negative_cache_lookup (const gchar *url)
+{
+  negative_entry *entry;
+
+  entry = g_hash_table_lookup (negative_cache, url);
+  if (entry && (entry->expires <= g_get_monotonic_time ()))
+    {
+      g_hash_table_remove (negative_cache, url);
+      return NULL;
+    }
+
+  return entry;
+}
+
+static void
+negative_cache_add (const gchar  *url,
+                    glong         code,
+                    guint         ttl)
+{
+  negative_entry *entry;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+
+  if (g_hash_table_size (negative_cache) >= NEGATIVE_CACHE_MAX)
+    g_hash_table_foreach_remove (negative_cache, negative_entry_expired, &now);
+
+  if (g_hash_table_size (negative_cache) >= NEGATIVE_CACHE_MAX)
+    return;
+
+  entry = g_new0 (negative_entry, 1);
+  entry->code = code;
+  entry->expires = now + (gint64) ttl * G_USEC_PER_SEC;
+  g_hash_table_replace (negative_cache, g_strdup (url), entry);
+
+  stats.negative_inserts++;
+}
+
+static void
+negative_cache_update (http_transfer *transfer)
+{
+  guint ttl;
+
+  /* only enrichment targets, the poll has to report its errors */
+  if (!transfer->cacheable || transfer->pass_ifmodsince || transfer->rate_limited)
+    return;
+
+  switch (transfer->code)
+    {
+      case RESPONSE_CODE_NOT_FOUND:
+      case RESPONSE_CODE_GONE:
+        ttl = NEGATIVE_TTL_NOT_FOUND;
+        break;
+      case RESPONSE_CODE_UNAUTHORIZED:
+      case RESPONSE_CODE_FORBIDDEN:
+        ttl = NEGATIVE_TTL_FORBIDDEN;
+        break;
+      default:
+        if (transfer->code < RESPONSE_CODE_SERVER_ERROR)
+          return;
+        ttl = NEGATIVE_TTL_SERVER_ERROR;
+        break;
+    }
+
+  negative_cache_add (transfer->url, transfer->code, ttl);
+}
+
+
+/*
+ * record and replay of HTTP exchanges - each one is stored as
+ * NNNNNN.json with the request, response headers and timing and
+ * NNNNNN.body with the raw response body
+ */
+static gboolean
+record_write (const gchar  *path,
+              const gchar  *data,
+              gsize         length)
+{
+  gssize written;
+  gint fd, saved_errno;
+
+  /* private repository titles end up here - readable by the user only */
+  fd = open (path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return FALSE;
+
+  while (length > 0)
+    {
+      written = write (fd, data, length);
+      if ((written < 0) && (errno == EINTR))
+        continue;
+      if (written < 0)
+        {
+          saved_errno = errno;
+          close (fd);
+          errno = saved_errno;
+          return FALSE;
+        }
+
+      data += written;
+      length -= written;
+    }
+
+  return (close (fd) == 0);
+}
+
+/*
+ * reused directory - the session goes on after the last recorded exchange
+ */
+static gboolean
+record_open (const gchar *dir)
+{
+  const gchar *name;
+  GDir *directory;
+  GError *error;
+  guint seq;
+
+  error = NULL;
+  directory = g_dir_open (dir, 0, &error);
+  if (!directory)
+    {
+      print_log (LOG_ERR, "cannot open record directory: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  while ((name = g_dir_read_name (directory)))
+    {
+      seq = (guint) g_ascii_strtoull (name, NULL, 10);
+      record_seq = MAX (record_seq, seq);
+    }
+  g_dir_close (directory);
+
+  if (record_seq)
+    print_log (LOG_INFO, "recording after exchange %06u in %s\n", record_seq, dir);
+
+  return TRUE;
+}
+
+static GString *
+record_redact (const gchar  *data,
+               gsize         length)
+{
+  GString *redacted;
+  const gchar *token;
+  gsize token_length, i;
+
+  token = TOKEN_STR;
+  token_length = strlen (token);
+  redacted = g_string_sized_new (length);
+
+  for (i = 0; i < length; )
+    {
+      if (token_length && (length - i >= token_length) && !memcmp (data + i, token, token_length))
+        {
+          g_string_append (redacted, RECORD_REDACTED);
+          i += token_length;
+        }
+      else
+        g_string_append_c (redacted, data[i++]);
+    }
+
+  return redacted;
+}
+
+static void
+record_exchange (http_transfer  *transfer,
+                 CURLcode        status)
+{
+  struct curl_slist *header;
+  json_t *request_headers, *exchange;
+  GString *redacted, *url, *headers;
+  gchar *path, *dump;
+
+  record_seq++;
+
+  request_headers = json_array ();
+  for (header = transfer->headers; header; header = header->next)
+    {
+      redacted = record_redact (header->data, strlen (header->data));
+      json_array_append_new (request_headers, json_string (redacted->str));
+      g_string_free (redacted, TRUE);
+    }
+
+  url = record_redact (transfer->url, strlen (transfer->url));
+  headers = record_redact (transfer->raw_headers->str, transfer->raw_headers->len);
+
+  exchange = json_pack ("{s:s, s:s, s:o, s:I, s:i, s:I, s:I, s:I, s:s}",
+                        "method", transfer->method ? transfer->method : "GET",
+                        "url", url->str,
+                        "request_headers", request_headers,
+                        "code", (json_int_t) transfer->code,
+                        "status", (gint) status,
+                        "time", (json_int_t) (g_get_real_time () / G_USEC_PER_SEC),
+                        "first_byte_us", (json_int_t) (transfer->first_byte ? transfer->first_byte - transfer->started : 0),
+                        "duration_us", (json_int_t) (g_get_monotonic_time () - transfer->started),
+                        "response_headers", headers->str);
+
+  path = g_strdup_printf ("%s/%06u.json", opt_record_dir, record_seq);
+  dump = json_dumps (exchange, JSON_INDENT (2));
+  if (!dump || !record_write (path, dump, strlen (dump)))
+    print_log (LOG_ERR, "cannot record HTTP exchange to %s: %s\n", path, g_strerror (errno));
+  free (dump);
+  g_free (path);
+
+  redacted = record_redact (transfer->chunk.data, transfer->chunk.size);
+  path = g_strdup_printf ("%s/%06u.body", opt_record_dir, record_seq);
+  if (!record_write (path, redacted->str, redacted->len))
+    print_log (LOG_ERR, "cannot record HTTP exchange to %s: %s\n", path, g_strerror (errno));
+  g_free (path);
+
+  g_string_free (redacted, TRUE);
+  g_string_free (headers, TRUE);
+  g_string_free (url, TRUE);
+  json_decref (exchange);
+}
+
+static void
+recorded_exchange_free (gpointer data)
+{
+  recorded_exchange *exchange;
+
+  exchange = (recorded_exchange*) data;
+
+  g_free (exchange->headers);
+  g_free (exchange->body);
+  g_free (exchange);
+}
+
+static void
+replay_queue_free (gpointer data)
+{
+  g_queue_free_full ((GQueue*) data, recorded_exchange_free);
+}
+
+static gboolean
+replay_load (const gchar *dir)
+{
+  recorded_exchange *exchange;
+  const gchar *method, *url, *headers, *name;
+  json_int_t code, first_byte, duration;
+  json_error_t json_error;
+  json_t *json_root, *json_time;
+  GList *names, *iter;
+  GError *error;
+  GQueue *queue;
+  gchar *path, *key;
+  gint status;
+  GDir *directory;
+
+  error = NULL;
+  directory = g_dir_open (dir, 0, &error);
+  if (!directory)
+    {
+      print_log (LOG_ERR, "cannot open replay directory: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  /* exchanges of one URL are replayed in the recorded order */
+  names = NULL;
+  while ((name = g_dir_read_name (directory)))
+    if (g_str_has_suffix (name, ".json"))
+      names = g_list_prepend (names, g_strndup (name, strlen (name) - 5));
+  g_dir_close (directory);
+  names = g_list_sort (names, (GCompareFunc) strcmp);
+
+  replay_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, replay_queue_free);
+
+  for (iter = names; iter; iter = iter->next)
+    {
+      path = g_strdup_printf ("%s/%s.json", dir, (gchar*) iter->data);
+      json_root = json_load_file (path, 0, &json_error);
+      g_free (path);
+
+      if (!json_root || json_unpack (json_root, "{s:s, s:s, s:I, s:i, s:I, s:I, s:s}",
+                                     "method", &method, "url", &url, "code", &code,
+                                     "status", &status, "first_byte_us", &first_byte,
+                                     "duration_us", &duration, "response_headers", &headers))
+        {
+          print_log (LOG_ERR, "invalid recorded HTTP exchange %s\n", (gchar*) iter->data);
+          if (json_root)
+            json_decref (json_root);
+          continue;
+        }
+
+      exchange = g_new0 (recorded_exchange, 1);
+      exchange->code = (glong) code;
+      exchange->status = (CURLcode) status;
+      exchange->first_byte = first_byte;
+      exchange->duration = duration;
+      exchange->headers = g_strdup (headers);
+
+      /* the replay starts at the time of the first recording */
+      json_time = json_object_get (json_root, "time");
+      exchange->time = json_is_integer (json_time) ? json_integer_value (json_time) : 0;
+      if (exchange->time && (!replay_clock || (exchange->time < replay_clock)))
+        replay_clock = exchange->time;
+
+      path = g_strdup_printf ("%s/%s.body", dir, (gchar*) iter->data);
+      if (!g_file_get_contents (path, &exchange->body, &exchange->size, NULL))
+        exchange->body = g_strdup ("");
+      g_free (path);
+
+      key = g_strdup_printf ("%s %s", method, url);
+      queue = g_hash_table_lookup (replay_index, key);
+      if (!queue)
+        {
+          queue = g_queue_new ();
+          g_hash_table_insert (replay_index, g_strdup (key), queue);
+        }
+      g_queue_push_tail (queue, exchange);
+      g_free (key);
+
+      json_decref (json_root);
+    }
+
+  print_log (LOG_INFO, "replaying %u HTTP exchanges from %s\n", g_list_length (names), dir);
+  g_list_free_full (names, g_free);
+
+  return TRUE;
+}
+
+/*
+ * take the next recording of the request - unknown requests fail
+ * like an unreachable host
+ */
+static void
+replay_take (http_transfer *transfer)
+{
+  GString *url;
+  GQueue *queue;
+  gchar *key;
+
+  url = record_redact (transfer->url, strlen (transfer->url));
+  key = g_strdup_printf ("%s %s", transfer->method ? transfer->method : "GET", url->str);
+  queue = g_hash_table_lookup (replay_index, key);
+
+  transfer->replay = queue ? g_queue_pop_head (queue) : NULL;
+  if (!transfer->replay)
+    {
+      print_log (LOG_INFO, "no recorded HTTP exchange left - %s\n", key);
+      transfer->replay = g_new0 (recorded_exchange, 1);
+      transfer->replay->status = CURLE_COULDNT_CONNECT;
+    }
+
+  replay_clock = MAX (replay_clock, transfer->replay->time);
+
+  transfer->replay_due = transfer->started;
+  if (opt_replay_speed > 0)
+    transfer->replay_due += (gint64) (transfer->replay->duration / opt_replay_speed);
+
+  replay_pending = g_list_append (replay_pending, transfer);
+
+  g_free (key);
+  g_string_free (url, TRUE);
+}
+
+
+/*
+ * polls of a replayed session follow the recorded timestamps, scaled by
+ * the replay speed - the normal interval once the lane's recordings run out
+ */
+static guint
+replay_poll_delay (poll_lane  *lane,
+                   guint       interval)
+{
+  recorded_exchange *next;
+  GQueue *queue;
+  gchar *key;
+
+  key = g_strdup_printf ("GET %s", lane->url);
+  queue = g_hash_table_lookup (replay_index, key);
+  g_free (key);
+
+  next = queue ? g_queue_peek_head (queue) : NULL;
+  if (!next || !next->time || !replay_clock)
+    return interval;
+
+  if (opt_replay_speed <= 0)
+    return 0;
+
+  return (guint) (MAX (0, next->time - replay_clock) / opt_replay_speed);
+}
+
+
+/*
+ * free http transfer
+ */
+static void
+http_transfer_free (http_transfer *transfer)
+{
+  if (transfer->chunk.data)
+    free (transfer->chunk.data);
+  if (transfer->curl)
+    curl_easy_cleanup (transfer->curl);
+  if (transfer->headers)
+    curl_slist_free_all (transfer->headers);
+
+  if (transfer->raw_headers)
+    g_string_free (transfer->raw_headers, TRUE);
+  if (transfer->replay)
+    recorded_exchange_free (transfer->replay);
+
+  g_free (transfer->url);
+  g_free (transfer->etag);
+  g_free (transfer->last_modified);
+  g_free (transfer->next_page);
+  g_free (transfer);
+}
+
+
+/*
+ * point curl callbacks at the transfer
+ */
+static void
+http_transfer_bind (http_transfer *transfer)
+{
+  curl_easy_setopt (transfer->curl, CURLOPT_PRIVATE, transfer);
+  curl_easy_setopt (transfer->curl, CURLOPT_HEADERDATA, transfer);
+  curl_easy_setopt (transfer->curl, CURLOPT_WRITEDATA, &transfer->chunk);
+}
+
+
+/*
+ * new http transfer
+ */
+static http_transfer *
+http_transfer_new (const gchar  *url,
+                   gboolean      api_request,
+                   gboolean      pass_ifmodsince)
+{
+  http_transfer *transfer;
+  cache_entry *entry;
+  gchar *header;
+
+  transfer = g_new0 (http_transfer, 1);
+  transfer->url = g_strdup (url);
+  transfer->host = host_lookup (url);
+  transfer->api_request = api_request;
+  transfer->ratelimit_remaining = -1;
+  transfer->cacheable = TRUE;
+  transfer->pass_ifmodsince = pass_ifmodsince;
+
+  if (opt_record_dir)
+    transfer->raw_headers = g_string_new (NULL);
+
+  /* init buffer for incoming data */
+  transfer->chunk.data = malloc(1);
+  transfer->chunk.size = 0;
+
+  /* init the curl session */
+  transfer->curl = curl_easy_init();
+  if (!transfer->curl)
+    {
+      print_log (LOG_ERR, "curl_easy_init() failed\n");
+      http_transfer_free (transfer);
+      return NULL;
+    }
+
+  /* set 'url' to use in the request */
+  curl_easy_setopt (transfer->curl, CURLOPT_URL, url);
+
+  /* DNS and TLS sessions are shared by all transfers */
+  curl_easy_setopt (transfer->curl, CURLOPT_SHARE, share);
+  curl_easy_setopt (transfer->curl, CURLOPT_DNS_CACHE_TIMEOUT, DNS_CACHE_TIMEOUT);
+
+  /* GitHub API v3 requires a 'User-Agent' header */
+  transfer->headers = curl_slist_append (transfer->headers, USER_AGENT_HEADER);
+
+  /* set personal access token - it must not leak to other hosts */
+  if (api_request)
+    transfer->headers = curl_slist_append (transfer->headers, ACCESS_TOKEN_HEADER);
+
+  /* revalidate stale cache entry */
+  entry = http_cache_lookup (url);
+  if (entry && entry->etag)
+    {
+      header = g_strdup_printf ("If-None-Match: %s", entry->etag);
+      transfer->headers = curl_slist_append (transfer->headers, header);
+      g_free (header);
+    }
+  else if (entry && entry->last_modified && !pass_ifmodsince)
+    {
+      header = g_strdup_printf ("If-Modified-Since: %s", entry->last_modified);
+      transfer->headers = curl_slist_append (transfer->headers, header);
+      g_free (header);
+    }
+
+  /* set custom HTTP headers */
+  curl_easy_setopt (transfer->curl, CURLOPT_HTTPHEADER, transfer->headers);
+
+  /* set callbacks for received headers and data */
+  curl_easy_setopt (transfer->curl, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt (transfer->curl, CURLOPT_WRITEFUNCTION, write_callback);
+  http_transfer_bind (transfer);
+
+  /* maximum time the request is allowed to take - 30s */
+  curl_easy_setopt (transfer->curl, CURLOPT_TIMEOUT, REQUEST_TIMEOUT);
+
+  /* connect and TLS phases are watched separately in http_perform() */
+  curl_easy_setopt (transfer->curl, CURLOPT_CONNECTTIMEOUT_MS, (glong) (opt_connect_timeout + opt_tls_timeout));
+
+  /* abort trickling responses */
+  curl_easy_setopt (transfer->curl, CURLOPT_LOW_SPEED_LIMIT, (glong) opt_low_speed_limit);
+  curl_easy_setopt (transfer->curl, CURLOPT_LOW_SPEED_TIME, (glong) opt_low_speed_time);
+
+  /* set 'If-Modified-Since' value */
+  if (pass_ifmodsince)
+    {
+      curl_easy_setopt (transfer->curl, CURLOPT_FILETIME, 1L);
+      curl_easy_setopt (transfer->curl, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
+      curl_easy_setopt (transfer->curl, CURLOPT_TIMEVALUE, last_mod);
+    }
+
+  return transfer;
+}
+
+
+/*
+ * current phase of the transfer
+ */
+static transfer_phase
+http_transfer_phase (http_transfer  *transfer,
+                     gdouble        *connect_time)
+{
+  gdouble appconnect_time;
+
+  *connect_time = 0;
+  appconnect_time = 0;
+
+  curl_easy_getinfo (transfer->curl, CURLINFO_CONNECT_TIME, connect_time);
+  curl_easy_getinfo (transfer->curl, CURLINFO_APPCONNECT_TIME, &appconnect_time);
+
+  if (*connect_time <= 0)
+    return PHASE_CONNECT;
+
+  if ((appconnect_time <= 0) && g_str_has_prefix (transfer->url, "https://") && !transfer->first_byte)
+    return PHASE_TLS;
+
+  if (!transfer->first_byte)
+    return PHASE_FIRST_BYTE;
+
+  return PHASE_TRANSFER;
+}
+
+
+/*
+ * start/finish http transfer
+ */
+static void
+http_transfer_start (http_transfer  *transfer,
+                     gboolean        fresh_connect)
+{
+  if (fresh_connect)
+    curl_easy_setopt (transfer->curl, CURLOPT_FRESH_CONNECT, 1L);
+
+  transfer->started = g_get_monotonic_time ();
+  stats.requests++;
+  http_in_flight++;
+
+  /* recorded response instead of the network */
+  if (replay_index)
+    replay_take (transfer);
+  else
+    curl_multi_add_handle (multi, transfer->curl);
+
+  if (trace_buffer)
+    {
+      transfer->trace_id = trace_next_id++;
+      transfer->trace_parent = trace_current ();
+    }
+}
+
+static void
+http_transfer_finish (http_transfer  *transfer,
+                      CURLcode        status)
+{
+  gdouble connect_time;
+
+  /* low-speed and total timeouts are detected by curl itself */
+  if (status == CURLE_OPERATION_TIMEDOUT)
+    stats.timeouts[http_transfer_phase (transfer, &connect_time)]++;
+
+  curl_multi_remove_handle (multi, transfer->curl);
+  if (!transfer->replay)
+    curl_easy_getinfo (transfer->curl, CURLINFO_RESPONSE_CODE, &transfer->code);
+  http_in_flight--;
+
+  /* transfers cancelled by us aren't part of the traffic */
+  if (opt_record_dir && (status != CURLE_ABORTED_BY_CALLBACK))
+    record_exchange (transfer, status);
+
+  transfer->status = status;
+  transfer->done = TRUE;
+
+  trace_transfer (transfer->url, transfer->started, transfer->trace_id, transfer->trace_parent, transfer->code);
+}
+
+
+/*
+ * abort the transfer if it's stuck in connect, TLS or first byte phase
+ */
+static void
+http_transfer_check_timeouts (http_transfer  *transfer,
+                              gint64          now)
+{
+  transfer_phase phase;
+  gdouble connect_time;
+  gint64 elapsed;
+  guint timeout;
+
+  /* replayed transfers end the way they were recorded */
+  if (transfer->replay)
+    return;
+
+  elapsed = (now - transfer->started) / 1000;
+  phase = http_transfer_phase (transfer, &connect_time);
+
+  switch (phase)
+    {
+      case PHASE_CONNECT:
+        timeout = opt_connect_timeout;
+        break;
+      case PHASE_TLS:
+        elapsed -= (gint64) (connect_time * 1000);
+        timeout = opt_tls_timeout;
+        break;
+      case PHASE_FIRST_BYTE:
+        timeout = opt_first_byte_timeout;
+        break;
+      default:
+        return;
+    }
+
+  if (elapsed < timeout)
+    return;
+
+  print_log (LOG_ERR, "curl request error: %s timeout (%ums) - %s\n", phase_names[phase], timeout, transfer->url);
+  http_transfer_finish (transfer, CURLE_OPERATION_TIMEDOUT);
+}
+
+
+/*
+ * finish replayed transfers which are due - the recorded response
+ * goes through the same callbacks as the one from the network
+ */
+static void
+replay_collect (void)
+{
+  recorded_exchange *exchange;
+  http_transfer *transfer;
+  GList *iter, *next;
+  gchar **lines;
+  gint64 now;
+  guint i;
+
+  now = g_get_monotonic_time ();
+
+  for (iter = replay_pending; iter; iter = next)
+    {
+      next = iter->next;
+      transfer = (http_transfer*) iter->data;
+      exchange = transfer->replay;
+
+      if (transfer->replay_due > now)
+        continue;
+
+      replay_pending = g_list_delete_link (replay_pending, iter);
+
+      if (exchange->first_byte)
+        transfer->first_byte = transfer->started +
+                               (opt_replay_speed > 0 ? (gint64) (exchange->first_byte / opt_replay_speed) : 0);
+
+      lines = g_strsplit (exchange->headers ? exchange->headers : "", "\n", -1);
+      for (i = 0; lines[i] && lines[i][0]; i++)
+        header_callback (lines[i], 1, strlen (lines[i]), transfer);
+      g_strfreev (lines);
+
+      write_callback (exchange->body, 1, exchange->size, &transfer->chunk);
+      transfer->code = exchange->code;
+
+      http_transfer_finish (transfer, exchange->status);
+    }
+}
+
+static void dump_service (void);
+
+/*
+ * wait for network activity or the next replayed response,
+ * a state dump requested meanwhile is taken right here
+ */
+static void
+http_wait (void)
+{
+  struct curl_waitfd dump_fd;
+  http_transfer *transfer;
+  gint64 due;
+  GList *iter;
+  gint active;
+
+  if (!replay_index)
+    {
+      dump_fd.fd = dump_pipe[0];
+      dump_fd.events = CURL_WAIT_POLLIN;
+      dump_fd.revents = 0;
+
+      active = 0;
+      curl_multi_wait (multi, &dump_fd, (dump_pipe[0] >= 0) ? 1 : 0, MULTI_WAIT_TIMEOUT, &active);
+
+      /* the poll cycle blocks the loop, transfers moving keep us alive */
+      if (active > 0)
+        __atomic_store_n (&loop_progress, g_get_monotonic_time (), __ATOMIC_RELEASE);
+
+      dump_service ();
+      return;
+    }
+
+  due = g_get_monotonic_time () + MULTI_WAIT_TIMEOUT * 1000;
+  for (iter = replay_pending; iter; iter = iter->next)
+    {
+      transfer = (http_transfer*) iter->data;
+      due = MIN (due, transfer->replay_due);
+    }
+
+  due -= g_get_monotonic_time ();
+  if (due > 0)
+    g_usleep ((gulong) due);
+
+  __atomic_store_n (&loop_progress, g_get_monotonic_time (), __ATOMIC_RELEASE);
+  dump_service ();
+}
+
+
+/*
+ * read finished transfers from the multi handle
+ */
+static void
+http_collect_messages (void)
+{
+  http_transfer *transfer;
+  CURLMsg *msg;
+  gint left;
+
+  while ((msg = curl_multi_info_read (multi, &left)))
+    {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (gchar**) &transfer);
+      http_transfer_finish (transfer, msg->data.result);
+    }
+
+  if (replay_pending)
+    replay_collect ();
+}
+
+
+/*
+ * serve fresh responses and known failures from cache, don't
+ * bother hosts with open circuit or rate limited hosts
+ */
+static gboolean
+http_transfer_admit (http_transfer *transfer)
+{
+  negative_entry *negative;
+  cache_entry *entry;
+
+  /* fresh response is cached */
+  entry = transfer->cacheable ? http_cache_lookup (transfer->url) : NULL;
+  if (http_cache_fresh (entry))
+    {
+      http_cache_serve (transfer, entry);
+      stats.cache_hits++;
+      return FALSE;
+    }
+
+  /* known-bad target - answer with the remembered status */
+  if (transfer->cacheable && !transfer->pass_ifmodsince &&
+      (negative = negative_cache_lookup (transfer->url)))
+    {
+      transfer->negative_hit = TRUE;
+      transfer->done = TRUE;
+      transfer->status = CURLE_OK;
+      transfer->code = negative->code;
+      stats.negative_hits++;
+      return FALSE;
+    }
+
+  /* host asked us to back off - keep the request for later */
+  if (host_backoff_remaining (transfer->host) > 0)
+    {
+      transfer->host->deferred++;
+      transfer->deferred = TRUE;
+      transfer->done = TRUE;
+      transfer->status = CURLE_AGAIN;
+      return FALSE;
+    }
+
+  if (host_allow_request (transfer->host))
+    return TRUE;
+
+  transfer->short_circuited = TRUE;
+  transfer->done = TRUE;
+  transfer->status = CURLE_COULDNT_CONNECT;
+
+  return FALSE;
+}
+
+
+/*
+ * update latency, connection and host statistics of finished transfer
+ */
+static void
+http_transfer_account (http_transfer *transfer)
+{
+  glong connects;
+
+  /* update first byte latency distribution */
+  if (transfer->status == CURLE_OK && transfer->first_byte)
+    {
+      first_byte_latency.samples[first_byte_latency.next] = (transfer->first_byte - transfer->started) / 1000;
+      first_byte_latency.next = (first_byte_latency.next + 1) % LATENCY_SAMPLES;
+      if (first_byte_latency.count < LATENCY_SAMPLES)
+        first_byte_latency.count++;
+    }
+
+  /* was the request served on a warm connection? */
+  if (transfer->status == CURLE_OK)
+    {
+      connects = 0;
+      curl_easy_getinfo (transfer->curl, CURLINFO_NUM_CONNECTS, &connects);
+      transfer->reused = (connects == 0);
+
+      if (transfer->reused)
+        transfer->host->connections_reused++;
+      else
+        transfer->host->connections_new++;
+    }
+
+  if (transfer->status == CURLE_OK)
+    host_record_rate_limit (transfer->host, transfer);
+
+  /* revalidated or new response */
+  if ((transfer->status == CURLE_OK) && transfer->cacheable)
+    {
+      if (transfer->code == RESPONSE_CODE_NOT_MODIFIED && http_cache_lookup (transfer->url))
+        stats.cache_stale++;
+      else
+        stats.cache_misses++;
+
+      http_cache_update (transfer);
+      negative_cache_update (transfer);
+    }
+
+  /* client errors don't say anything about the host health */
+  host_record_result (transfer->host, (transfer->status == CURLE_OK) &&
+                                      (transfer->code < RESPONSE_CODE_SERVER_ERROR));
+}
+
+
+/*
+ * perform a blocking request - if the first byte doesn't arrive within
+ * the p95 threshold, idempotent requests are duplicated on a fresh
+ * connection and whichever answers first wins
+ */
+static CURLcode
+http_perform (http_transfer  *transfer,
+              gboolean        idempotent)
+{
+  http_transfer *hedge;
+  http_transfer swap;
+  gint64 hedge_at, now;
+  gboolean hedged;
+  gint running;
+
+  hedge = NULL;
+  hedged = FALSE;
+
+  if (!http_transfer_admit (transfer))
+    return transfer->status;
+
+  http_transfer_start (transfer, FALSE);
+  hedge_at = transfer->started + (gint64) hedge_threshold () * 1000;
+
+  for (;;)
+    {
+      curl_multi_perform (multi, &running);
+      http_collect_messages ();
+
+      now = g_get_monotonic_time ();
+      if (!transfer->done)
+        http_transfer_check_timeouts (transfer, now);
+      if (hedge && !hedge->done)
+        http_transfer_check_timeouts (hedge, now);
+
+      /* first successful answer wins */
+      if ((transfer->done && transfer->status == CURLE_OK) ||
+          (hedge && hedge->done && hedge->status == CURLE_OK))
+        break;
+
+      /* all requests failed */
+      if (transfer->done && (!hedge || hedge->done))
+        break;
+
+      /* no first byte so far - send a duplicate on a fresh connection */
+      if (opt_hedge && idempotent && !hedged && !transfer->first_byte && now >= hedge_at)
+        {
+          hedged = TRUE;
+          hedge = http_transfer_new (transfer->url, transfer->api_request, transfer->pass_ifmodsince);
+          if (hedge)
+            {
+              print_log (LOG_INFO, "no response after %ums, hedging request - %s\n",
+                         (guint) ((now - transfer->started) / 1000), transfer->url);
+              http_transfer_start (hedge, TRUE);
+              stats.hedges_sent++;
+            }
+        }
+
+      http_wait ();
+    }
+
+  if (hedge)
+    {
+      /* cancel the loser */
+      if (!hedge->done)
+        http_transfer_finish (hedge, CURLE_ABORTED_BY_CALLBACK);
+      if (!transfer->done)
+        http_transfer_finish (transfer, CURLE_ABORTED_BY_CALLBACK);
+
+      /* both handles are out of the multi stack, so it's safe to swap them */
+      if (hedge->status == CURLE_OK && transfer->status != CURLE_OK)
+        {
+          swap = *transfer;
+          *transfer = *hedge;
+          *hedge = swap;
+          http_transfer_bind (transfer);
+          http_transfer_bind (hedge);
+          stats.hedges_won++;
+        }
+
+      http_transfer_free (hedge);
+    }
+
+  http_transfer_account (transfer);
+  return transfer->status;
+}
+
+
+/*
+ * AIMD concurrency controller for the enrichment fan-out - grow the
+ * window by one request per window of successes, halve it once per
+ * round trip on 403/429, Retry-After, errors or rising latency
+ */
+static void
+concurrency_update (http_transfer *transfer)
+{
+  gboolean congested;
+  gdouble latency;
+  gint64 now;
+
+  if (transfer->short_circuited)
+    return;
+
+  now = g_get_monotonic_time ();
+
+  congested = (transfer->status != CURLE_OK) ||
+              (transfer->code == RESPONSE_CODE_FORBIDDEN) ||
+              (transfer->code == RESPONSE_CODE_RATE_LIMITED) ||
+              (transfer->retry_after > 0);
+
+  /* compare smoothed latency with the lowest one seen recently */
+  if (!congested && transfer->first_byte)
+    {
+      latency = (transfer->first_byte - transfer->started) / 1000.0;
+
+      if (concurrency.latency > 0)
+        concurrency.latency += (latency - concurrency.latency) * AIMD_LATENCY_GAIN;
+      else
+        concurrency.latency = latency;
+
+      if ((concurrency.base_latency <= 0) || (concurrency.latency < concurrency.base_latency))
+        concurrency.base_latency = concurrency.latency;
+      else
+        concurrency.base_latency += (concurrency.latency - concurrency.base_latency) * AIMD_BASE_LATENCY_GAIN;
+
+      congested = (concurrency.latency > concurrency.base_latency * AIMD_LATENCY_FACTOR);
+    }
+
+  if (congested)
+    {
+      /* back off for the period requested by the server */
+      if (transfer->retry_after > 0)
+        concurrency.hold_until = MAX (concurrency.hold_until, now + (gint64) transfer->retry_after * G_USEC_PER_SEC);
+
+      /* requests sent before the last decrease saw the same congestion */
+      if (transfer->started <= concurrency.last_decrease)
+        return;
+
+      concurrency.window = MAX (concurrency.window * AIMD_DECREASE, 1.0);
+      concurrency.last_decrease = now;
+      concurrency.decreases++;
+
+      print_log (LOG_INFO, "enrichment concurrency decreased to %.1f (code=%ld latency=%.0fms)\n",
+                 concurrency.window, transfer->code, concurrency.latency);
+      return;
+    }
+
+  if (now < concurrency.hold_until)
+    return;
+
+  if (concurrency.window < opt_max_concurrency)
+    {
+      concurrency.window = MIN (concurrency.window + 1.0 / concurrency.window, (gdouble) opt_max_concurrency);
+      concurrency.increases++;
+    }
+}
+
+
+/*
+ * perform independent requests concurrently, at most 'window' at a time
+ */
+static void
+http_perform_many (GPtrArray *transfers)
+{
+  http_transfer *transfer;
+  GPtrArray *in_flight;
+  gint64 now;
+  gint running;
+  guint next, i;
+
+  in_flight = g_ptr_array_new ();
+  next = 0;
+
+  while ((next < transfers->len) || (in_flight->len > 0))
+    {
+      /* start new requests while the window allows it */
+      while ((next < transfers->len) && (in_flight->len < (guint) concurrency.window))
+        {
+          transfer = g_ptr_array_index (transfers, next++);
+          if (!http_transfer_admit (transfer))
+            continue;
+
+          http_transfer_start (transfer, FALSE);
+          g_ptr_array_add (in_flight, transfer);
+        }
+
+      concurrency.max_in_flight = MAX (concurrency.max_in_flight, in_flight->len);
+
+      curl_multi_perform (multi, &running);
+      http_collect_messages ();
+
+      now = g_get_monotonic_time ();
+      for (i = 0; i < in_flight->len; )
+        {
+          transfer = g_ptr_array_index (in_flight, i);
+          if (!transfer->done)
+            http_transfer_check_timeouts (transfer, now);
+
+          if (!transfer->done)
+            {
+              i++;
+              continue;
+            }
+
+          http_transfer_account (transfer);
+          concurrency_update (transfer);
+          g_ptr_array_remove_index_fast (in_flight, i);
+        }
+
+      if (in_flight->len > 0)
+        http_wait ();
+    }
+
+  g_ptr_array_free (in_flight, TRUE);
+}
+
+
+/*
+ * curl request
+ */
+static gchar *
+curl_request (const gchar  *url,
+              gboolean      pass_ifmodsince,
+              glong        *code)
+{
+  http_transfer *transfer;
+  trace_span *span;
+  CURLcode status;
+  gchar *data;
+
+  *code = 0;
+
+  transfer = http_transfer_new (url, TRUE, pass_ifmodsince);
+  if (!transfer)
+    return NULL;
+
+  span = trace_begin ("curl_request", "http");
+  PROBE (curl_request__entry, url);
+
+  /* perform a blocking request */
+  status = http_perform (transfer, TRUE);
+  if (transfer->short_circuited)
+    {
+      *code = RESPONSE_CODE_CIRCUIT_OPEN;
+      goto exit_null;
+    }
+
+  /* rate limiting was already logged */
+  if (transfer->deferred || transfer->rate_limited)
+    {
+      *code = RESPONSE_CODE_BACKOFF;
+      goto exit_null;
+    }
+
+  if (status != CURLE_OK)
+    {
+      print_log (LOG_ERR, "curl_easy_perform() failed: %s\n", curl_easy_strerror(status));
+      goto exit_null;
+    }
+
+  /* check response code */
+  *code = transfer->code;
+  if((*code != RESPONSE_CODE_OK) && (*code != RESPONSE_CODE_NOT_MODIFIED))
+    {
+      print_log (LOG_ERR, "curl request error: server responded with code %ld\n", *code);
+      goto exit_null;
+    }
+
+  /* the poll is latency-critical - count warm connection hits */
+  if (pass_ifmodsince && !transfer->from_cache)
+    {
+      if (transfer->reused)
+        stats.polls_warm++;
+      else
+        stats.polls_cold++;
+    }
+
+  /* read 'Last-Modified' value */
+  if (pass_ifmodsince)
+    {
+      if (*code == RESPONSE_CODE_NOT_MODIFIED)
+        goto exit_null;
+
+      /* replayed response didn't go through curl */
+      if (transfer->replay)
+        last_mod = transfer->last_modified ? (glong) curl_getdate (transfer->last_modified, NULL) : 0;
+      else
+        curl_easy_getinfo(transfer->curl, CURLINFO_FILETIME, &last_mod);
+    }
+
+  /* next page of a paginated list */
+  g_free (next_page);
+  next_page = transfer->next_page;
+  transfer->next_page = NULL;
+
+  /* return received data */
+  PROBE (curl_request__return, url, *code, transfer->chunk.size, g_get_monotonic_time () - transfer->started);
+
+  data = transfer->chunk.data;
+  transfer->chunk.data = NULL;
+  http_transfer_free (transfer);
+
+  trace_end (span, url);
+  return data;
+
+exit_null:
+
+  g_free (next_page);
+  next_page = NULL;
+
+  PROBE (curl_request__return, url, *code, transfer->chunk.size, g_get_monotonic_time () - transfer->started);
+  http_transfer_free (transfer);
+  trace_end (span, url);
+  return NULL;
+}
+
+
+/*
+ * avatar store - images are stored once under their content hash,
+ * the index maps user IDs to the avatar URL and the image hash
+ */
+static void
+avatar_entry_free (gpointer data)
+{
+  avatar_entry *entry;
+
+  entry = (avatar_entry*) data;
+
+  g_free (entry->url);
+  g_free (entry->hash);
+  g_free (entry);
+}
+
+static gchar *
+avatar_object_path (const gchar *hash)
+{
+  return g_build_filename (avatar_dir, hash, NULL);
+}
+
+/*
+ * image type from its magic bytes, notification servers go by the extension
+ */
+static const gchar *
+avatar_extension (const gchar  *data,
+                  gsize         size)
+{
+  if ((size >= 8) && !memcmp (data, "\x89PNG\r\n\x1a\n", 8))
+    return "png";
+  if ((size >= 3) && !memcmp (data, "\xff\xd8\xff", 3))
+    return "jpg";
+  if ((size >= 6) && (!memcmp (data, "GIF87a", 6) || !memcmp (data, "GIF89a", 6)))
+    return "gif";
+  if ((size >= 12) && !memcmp (data, "RIFF", 4) && !memcmp (data + 8, "WEBP", 4))
+    return "webp";
+
+  return "png";
+}
+
+/*
+ * avatars of versions before the store were kept as /tmp/<user ID>.png,
+ * they are removed once
+ */
+static void
+avatar_remove_legacy (void)
+{
+  GDir *directory;
+  const gchar *name;
+  struct stat st;
+  gchar *done, *path;
+  guint i;
+
+  done = g_build_filename (avatar_dir, AVATAR_LEGACY_DONE, NULL);
+  if (access (done, F_OK) == 0)
+    {
+      g_free (done);
+      return;
+    }
+
+  directory = g_dir_open (AVATAR_LEGACY_DIR, 0, NULL);
+  while (directory && (name = g_dir_read_name (directory)))
+    {
+      for (i = 0; g_ascii_isdigit (name [i]); i++);
+      if ((i == 0) || strcmp (name + i, ".png"))
+        continue;
+
+      path = g_build_filename (AVATAR_LEGACY_DIR, name, NULL);
+      if ((lstat (path, &st) == 0) && S_ISREG (st.st_mode) && (st.st_uid == getuid ()))
+        unlink (path);
+      g_free (path);
+    }
+
+  if (directory)
+    g_dir_close (directory);
+
+  g_file_set_contents (done, "", 0, NULL);
+  g_free (done);
+}
+
+/*
+ * earlier indexes have bare hashes of images stored as .png -
+ * images are renamed to their real type
+ */
+static void
+avatar_migrate (avatar_entry *entry)
+{
+  static const gchar *renamed[] = { "jpg", "gif", "webp" };
+  const gchar *extension;
+  gchar *path, *data, *hash;
+  gsize size;
+  guint i;
+
+  if (strchr (entry->hash, '.'))
+    return;
+
+  /* images are shared by users - the first one renames it */
+  hash = NULL;
+  for (i = 0; !hash && (i < G_N_ELEMENTS (renamed)); i++)
+    {
+      hash = g_strdup_printf ("%s.%s", entry->hash, renamed [i]);
+      path = avatar_object_path (hash);
+      if (access (path, F_OK) != 0)
+        {
+          g_free (hash);
+          hash = NULL;
+        }
+      g_free (path);
+    }
+
+  if (!hash)
+    {
+      path = g_strdup_printf ("%s/%s.png", avatar_dir, entry->hash);
+      extension = "png";
+      if (g_file_get_contents (path, &data, &size, NULL))
+        {
+          extension = avatar_extension (data, size);
+          g_free (data);
+        }
+
+      hash = g_strdup_printf ("%s.%s", entry->hash, extension);
+      if (strcmp (extension, "png"))
+        {
+          data = avatar_object_path (hash);
+          rename (path, data);
+          g_free (data);
+        }
+      g_free (path);
+    }
+
+  g_free (entry->hash);
+  entry->hash = hash;
+  avatar_index_dirty = TRUE;
+}
+
+static void
+avatar_index_load (void)
+{
+  avatar_entry *entry;
+  gchar *path, *contents, **lines, **fields;
+  guint i;
+
+  path = g_build_filename (avatar_dir, AVATAR_INDEX_FILE, NULL);
+  contents = NULL;
+
+  if (g_file_get_contents (path, &contents, NULL, NULL))
+    {
+      /* one entry per line - 'ID HASH URL' */
+      lines = g_strsplit (contents, "\n", -1);
+      for (i = 0; lines [i]; i++)
+        {
+          fields = g_strsplit (lines [i], " ", 3);
+          if (g_strv_length (fields) == 3)
+            {
+              entry = g_new0 (avatar_entry, 1);
+              entry->hash = g_strdup (fields [1]);
+              avatar_migrate (entry);
+              entry->url = g_strdup (fields [2]);
+              g_hash_table_replace (avatar_index, GUINT_TO_POINTER ((guint32) g_ascii_strtoull (fields [0], NULL, 10)), entry);
+            }
+          g_strfreev (fields);
+        }
+      g_strfreev (lines);
+    }
+
+  g_free (contents);
+  g_free (path);
+}
+
+static void
+avatar_index_save (void)
+{
+  GHashTableIter iter;
+  avatar_entry *entry;
+  trace_span *span;
+  GString *contents;
+  GError *error;
+  gpointer id;
+  gchar *path;
+
+  if (!avatar_index_dirty)
+    return;
+
+  span = trace_begin ("avatar_index_save", "flush");
+  contents = g_string_new (NULL);
+  error = NULL;
+
+  g_hash_table_iter_init (&iter, avatar_index);
+  while (g_hash_table_iter_next (&iter, &id, (gpointer*) &entry))
+    g_string_append_printf (contents, "%u %s %s\n", GPOINTER_TO_UINT (id), entry->hash, entry->url);
+
+  path = g_build_filename (avatar_dir, AVATAR_INDEX_FILE, NULL);
+  if (!g_file_set_contents (path, contents->str, contents->len, &error))
+    {
+      print_log (LOG_ERR, "cannot write avatar index: %s\n", error->message);
+      g_error_free (error);
+    }
+  else
+    avatar_index_dirty = FALSE;
+
+  g_free (path);
+  g_string_free (contents, TRUE);
+  trace_end (span, NULL);
+}
+
+/*
+ * path to the user's avatar, NULL if it's not stored or the URL changed
+ */
+static gchar *
+avatar_lookup (guint32       id,
+               const gchar  *url)
+{
+  avatar_entry *entry;
+  gchar *path;
+
+  entry = g_hash_table_lookup (avatar_index, GUINT_TO_POINTER (id));
+  if (!entry || (url && g_strcmp0 (entry->url, url)))
+    return NULL;
+
+  path = avatar_object_path (entry->hash);
+  if (access (path, F_OK) == 0)
+    return path;
+
+  g_free (path);
+  return NULL;
+}
+
+static gboolean
+avatar_hash_used (const gchar *hash)
+{
+  GHashTableIter iter;
+  avatar_entry *entry;
+
+  g_hash_table_iter_init (&iter, avatar_index);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &entry))
+    if (!g_strcmp0 (entry->hash, hash))
+      return TRUE;
+
+  return FALSE;
+}
+
+static gchar *
+avatar_store (guint32       id,
+              const gchar  *url,
+              const gchar  *data,
+              gsize         size)
+{
+  avatar_entry *entry;
+  GError *error;
+  gchar *digest, *hash, *path, *old_hash, *old_path;
+
+  error = NULL;
+  digest = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar*) data, size);
+  hash = g_strdup_printf ("%s.%s", digest, avatar_extension (data, size));
+  path = avatar_object_path (hash);
+  g_free (digest);
+
+  /* identical image is already there - just point the user at it */
+  if (access (path, F_OK) == 0)
+    stats.avatar_dedup++;
+  else if (g_file_set_contents (path, data, size, &error))
+    stats.avatar_writes++;
+  else
+    {
+      print_log (LOG_ERR, "cannot write avatar image: %s\n", error->message);
+      g_error_free (error);
+      g_free (hash);
+      g_free (path);
+      return NULL;
+    }
+
+  entry = g_hash_table_lookup (avatar_index, GUINT_TO_POINTER (id));
+  if (!entry)
+    {
+      entry = g_new0 (avatar_entry, 1);
+      g_hash_table_insert (avatar_index, GUINT_TO_POINTER (id), entry);
+    }
+
+  old_hash = entry->hash;
+  g_free (entry->url);
+  entry->url = g_strdup (url);
+  entry->hash = hash;
+  avatar_index_dirty = TRUE;
+
+  /* nobody else uses the previous image */
+  if (old_hash && g_strcmp0 (old_hash, hash) && !avatar_hash_used (old_hash))
+    {
+      old_path = avatar_object_path (old_hash);
+      unlink (old_path);
+      g_free (old_path);
+    }
+  g_free (old_hash);
+
+  return path;
+}
+
+
+/*
+ * store downloaded user avatar
+ */
+static gchar *
+prepare_avatar (guint32         id,
+                const gchar    *url,
+                http_transfer  *transfer)
+{
+  gchar *path;
+
+  /* the same user could be the author of more than one notification */
+  path = avatar_lookup (id, url);
+  if (path)
+    return path;
+
+  if (transfer->negative_hit)
+    return NULL;
+
+  if (transfer->short_circuited || transfer->deferred || transfer->rate_limited)
+    {
+      print_log (LOG_INFO, "avatars host unavailable - skipping user avatar\n");
+      return NULL;
+    }
+
+  if (transfer->status != CURLE_OK)
+    {
+      print_log (LOG_ERR, "curl_easy_perform() failed: %s\n", curl_easy_strerror(transfer->status));
+      goto error;
+    }
+
+  if (transfer->code != RESPONSE_CODE_OK)
+    {
+      print_log (LOG_ERR, "curl request error: server responded with code %ld\n", transfer->code);
+      goto error;
+    }
+
+  /* the image is stored only when it was received completely */
+  path = avatar_store (id, url, transfer->chunk.data, transfer->chunk.size);
+  if (!path)
+    goto error;
+
+  return path;
+
+error:
+
+  /* upss... something goes wrong */
+  print_log (LOG_ERR, "cannot prepare user avatar image\n");
+  return NULL;
+}
+
+
+/*
+ * mark-as-read - actions are collected for a moment and sent in one batch
+ */
+static http_transfer *
+http_transfer_write (const gchar  *url,
+                     const gchar  *method)
+{
+  http_transfer *transfer;
+
+  transfer = http_transfer_new (url, TRUE, FALSE);
+  if (!transfer)
+    return NULL;
+
+  /* empty body - 'Content-Length: 0' is required by the API */
+  curl_easy_setopt (transfer->curl, CURLOPT_CUSTOMREQUEST, method);
+  curl_easy_setopt (transfer->curl, CURLOPT_POSTFIELDS, "");
+  curl_easy_setopt (transfer->curl, CURLOPT_POSTFIELDSIZE, 0L);
+  transfer->cacheable = FALSE;
+  transfer->method = method;
+
+  return transfer;
+}
+
+static gboolean flush_mark_read (gpointer user_data);
+static gboolean store_remove_read (const gchar *thread_id, const gchar *repository);
+static void status_publish (void);
+
+static void
+schedule_mark_read (guint delay)
+{
+  if (!mark_read_source)
+    mark_read_source = g_timeout_add_seconds (delay, flush_mark_read, NULL);
+}
+
+static void
+queue_mark_read (const gchar  *thread_id,
+                 const gchar  *repository)
+{
+  if (thread_id)
+    g_hash_table_replace (mark_read_threads, g_strdup (thread_id), g_strdup (repository));
+  else
+    g_hash_table_add (mark_read_repos, g_strdup (repository));
+}
+
+static gboolean
+flush_mark_read (gpointer user_data)
+{
+  GHashTable *threads, *repos;
+  GHashTableIter iter;
+  GPtrArray *transfers, *keys;
+  http_transfer *transfer;
+  gchar *key, *repository, *url;
+  gboolean changed;
+  guint retry, i;
+
+  mark_read_source = 0;
+  retry = 0;
+  changed = FALSE;
+
+  /* actions clicked during the flush start a new batch */
+  threads = mark_read_threads;
+  repos = mark_read_repos;
+  mark_read_threads = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  mark_read_repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  transfers = g_ptr_array_new ();
+  keys = g_ptr_array_new ();
+
+  /* whole repositories */
+  g_hash_table_iter_init (&iter, repos);
+  while (g_hash_table_iter_next (&iter, (gpointer*) &key, NULL))
+    {
+      url = g_strdup_printf ("%s/notifications", key);
+      transfer = http_transfer_write (url, "PUT");
+      g_free (url);
+
+      if (transfer)
+        {
+          g_ptr_array_add (transfers, transfer);
+          g_ptr_array_add (keys, key);
+        }
+    }
+
+  /* single threads, unless the whole repository is marked anyway */
+  g_hash_table_iter_init (&iter, threads);
+  while (g_hash_table_iter_next (&iter, (gpointer*) &key, (gpointer*) &repository))
+    {
+      if (repository && g_hash_table_contains (repos, repository))
+        continue;
+
+      url = g_strdup_printf ("%s%s", GITHUB_API_THREADS, key);
+      transfer = http_transfer_write (url, "PATCH");
+      g_free (url);
+
+      if (transfer)
+        {
+          g_ptr_array_add (transfers, transfer);
+          g_ptr_array_add (keys, key);
+        }
+    }
+
+  http_perform_many (transfers);
+
+  for (i = 0; i < transfers->len; i++)
+    {
+      transfer = g_ptr_array_index (transfers, i);
+      key = g_ptr_array_index (keys, i);
+
+      /* API host is not available now - try again later */
+      if (transfer->short_circuited || transfer->deferred || transfer->rate_limited)
+        {
+          if (g_hash_table_contains (repos, key))
+            queue_mark_read (NULL, key);
+          else
+            queue_mark_read (key, g_hash_table_lookup (threads, key));
+
+          retry = MAX (retry, host_backoff_remaining (transfer->host));
+        }
+      else if ((transfer->status == CURLE_OK) &&
+               (transfer->code >= RESPONSE_CODE_OK) && (transfer->code < RESPONSE_CODE_REDIRECTION))
+        {
+          print_log (LOG_INFO, "marked as read: %s\n", transfer->url);
+          stats.marked_read++;
+
+          if (g_hash_table_contains (repos, key))
+            changed |= store_remove_read (NULL, key);
+          else
+            changed |= store_remove_read (key, NULL);
+        }
+      else
+        {
+          print_log (LOG_ERR, "cannot mark as read: url=%s code=%ld\n", transfer->url, transfer->code);
+          stats.mark_read_errors++;
+        }
+
+      http_transfer_free (transfer);
+    }
+
+  if (g_hash_table_size (mark_read_threads) || g_hash_table_size (mark_read_repos))
+    schedule_mark_read (MAX (retry, MARK_READ_DELAY));
+
+  /* status bars don't wait for the next poll */
+  if (changed)
+    status_publish ();
+
+  g_ptr_array_free (transfers, TRUE);
+  g_ptr_array_free (keys, TRUE);
+  g_hash_table_destroy (threads);
+  g_hash_table_destroy (repos);
+
+  return FALSE;
+}
+
+
+/*
+ * notification actions
+ */
+static void show_notification (gpointer data, gpointer user_data);
+static void free_notification (gpointer data, gpointer user_data);
+static GList *enrich_notifications (GList *notifications_list, GList **deferred);
+
+static void
+thread_actions_free (gpointer data)
+{
+  thread_actions *actions;
+
+  actions = (thread_actions*) data;
+
+  if (actions->lazy)
+    free_notification (actions->lazy, NULL);
+
+  g_free (actions->id);
+  g_free (actions->repository);
+  g_free (actions->url);
+  g_free (actions);
+}
+
+/*
+ * list-level fields only - the copy can be enriched later
+ */
+static notification *
+copy_notification (notification *notif)
+{
+  notification *copy;
+
+  copy = g_new0 (notification, 1);
+  copy->repository = g_strdup (notif->repository);
+  copy->repository_url = g_strdup (notif->repository_url);
+  copy->repository_api_url = g_strdup (notif->repository_api_url);
+  copy->type = g_strdup (notif->type);
+  copy->title = g_strdup (notif->title);
+  copy->reason = g_strdup (notif->reason);
+  copy->id = g_strdup (notif->id);
+  copy->updated_at = g_strdup (notif->updated_at);
+  copy->comment_url = g_strdup (notif->comment_url);
+
+  return copy;
+}
+
+/*
+ * lazy enrichment - author and avatar are fetched when the user asks,
+ * the popup is replaced by the complete one
+ */
+static void
+action_details (NotifyNotification  *notification,
+                char                *action,
+                gpointer             user_data)
+{
+  thread_actions *actions;
+  GList *notifications_list;
+
+  actions = (thread_actions*) user_data;
+  stats.lazy_enrichments++;
+
+  notifications_list = g_list_append (NULL, copy_notification (actions->lazy));
+  notifications_list = enrich_notifications (notifications_list, NULL);
+
+  /* failed or rate limited - the popup stays as it is */
+  if (!notifications_list)
+    {
+      print_log (LOG_INFO, "cannot fetch author of '%s'\n", actions->lazy->title);
+      return;
+    }
+
+  notify_notification_close (notification, NULL);
+
+  g_list_foreach (notifications_list, show_notification, NULL);
+  g_list_foreach (notifications_list, free_notification, NULL);
+  g_list_free (notifications_list);
+}
+
+static void
+action_open (NotifyNotification  *notification,
+             char                *action,
+             gpointer             user_data)
+{
+  thread_actions *actions;
+  GError *error;
+
+  actions = (thread_actions*) user_data;
+  error = NULL;
+
+  if (!g_app_info_launch_default_for_uri (actions->url, NULL, &error))
+    {
+      print_log (LOG_ERR, "cannot open '%s': %s\n", actions->url, error->message);
+      g_error_free (error);
+    }
+}
+
+static void
+action_mark_read (NotifyNotification  *notification,
+                  char                *action,
+                  gpointer             user_data)
+{
+  thread_actions *actions;
+
+  actions = (thread_actions*) user_data;
+
+  if (!g_strcmp0 (action, ACTION_MARK_REPO_READ))
+    queue_mark_read (NULL, actions->repository);
+  else
+    queue_mark_read (actions->id, actions->repository);
+
+  schedule_mark_read (MARK_READ_DELAY);
+}
+
+/*
+ * the reference is kept for the actions until the popup is closed - bounded,
+ * some servers never emit 'NotificationClosed' for expired popups
+ */
+static void
+release_popup (NotifyNotification *popup)
+{
+  GList *link;
+
+  link = g_queue_find (&action_popups, popup);
+  if (!link)
+    return;
+
+  g_queue_delete_link (&action_popups, link);
+  g_object_unref (G_OBJECT(popup));
+}
+
+static void
+track_popup (NotifyNotification *popup)
+{
+  NotifyNotification *oldest;
+  thread_actions *actions;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  g_queue_push_tail (&action_popups, popup);
+
+  while ((oldest = g_queue_peek_head (&action_popups)))
+    {
+      actions = g_object_get_data (G_OBJECT(oldest), "thread-actions");
+      if ((g_queue_get_length (&action_popups) <= ACTIONS_MAX) &&
+          (now - actions->shown < (gint64) ACTIONS_LIFETIME * G_USEC_PER_SEC))
+        break;
+
+      release_popup (oldest);
+    }
+}
+
+static void
+notification_closed (NotifyNotification  *notification,
+                     gpointer             user_data)
+{
+  release_popup (notification);
+}
+
+static gboolean
+add_thread_actions (NotifyNotification  *notif_to_show,
+                    notification        *notif)
+{
+  thread_actions *actions;
+
+  if (!server_caps [CAP_ACTIONS] || !notif->id)
+    return FALSE;
+
+  actions = g_new0 (thread_actions, 1);
+  actions->id = g_strdup (notif->id);
+  actions->repository = g_strdup (notif->repository_api_url);
+  actions->url = g_strdup (notif->html_url ? notif->html_url : notif->repository_url);
+  actions->shown = g_get_monotonic_time ();
+
+  /* actions share the data, it lives as long as the notification */
+  g_object_set_data_full (G_OBJECT(notif_to_show), "thread-actions", actions, thread_actions_free);
+
+  notify_notification_add_action (notif_to_show, ACTION_OPEN, "Open", action_open, actions, NULL);
+  notify_notification_add_action (notif_to_show, ACTION_MARK_READ, "Mark read", action_mark_read, actions, NULL);
+  if (actions->repository)
+    notify_notification_add_action (notif_to_show, ACTION_MARK_REPO_READ, "Mark repo read",
+                                    action_mark_read, actions, NULL);
+
+  /* not enriched yet */
+  if (!notif->user && notif->comment_url)
+    {
+      actions->lazy = copy_notification (notif);
+      notify_notification_add_action (notif_to_show, ACTION_DETAILS, "Show author", action_details, actions, NULL);
+    }
+
+  g_signal_connect (notif_to_show, "closed", G_CALLBACK (notification_closed), NULL);
+  track_popup (notif_to_show);
+  return TRUE;
+}
+
+
+/*
+ * Exception 1: notification server on KDE (version 1.0)
+ * doesn't understand '\n' - we have to replace it with <br\>
+ */
+static const gchar *
+server_newline (void)
+{
+  if ((g_strcmp0 (name, "Plasma") == 0) &&
+      (g_strcmp0 (vendor, "KDE") == 0) &&
+      (g_strcmp0 (version, "1.0") == 0))
+    {
+      return "<br/>";
+    }
+
+  return "\n";
+}
+
+
+/*
+ * cross-lane dedupe - a thread counts as shown only once it popped up
+ */
+static void
+thread_shown (gpointer data,
+              gpointer user_data)
+{
+  notification *notif;
+
+  notif = (notification*) data;
+
+  if (notif->id && notif->updated_at)
+    g_hash_table_replace (shown_threads, g_strdup (notif->id), g_strdup (notif->updated_at));
+}
+
+
+/*
+ * show notification
+ */
+static void
+show_notification (gpointer data,
+                   gpointer user_data)
+{
+  NotifyNotification *notif_to_show;
+  GString *body;
+  const gchar *newline;
+  gchar *bold, *bold_end;
+  gboolean with_actions;
+  notification *notif;
+  trace_span *span;
+  gint64 started G_GNUC_UNUSED;
+
+  notif = (notification*) data;
+  span = trace_begin ("show_notification", "deliver");
+  started = g_get_monotonic_time ();
+  PROBE (show_notification__entry, notif->html_url, notif->reason);
+  body = g_string_new (NULL);
+  newline = server_newline ();
+  bold = TAG_BOLD;
+  bold_end = TAG_BOLD_END;
+
+  /*
+   * notification servers that do not support body tags should
+   * filter them out, but to be sure let's remove them from body
+   */
+  if (!server_caps[CAP_BODY_MARKUP])
+    {
+      bold = "";
+      bold_end = "";
+    }
+
+  /*
+   * Exception 2: xfce4-notifyd notification server for Xfce,
+   * doesn't support properly hyperlinks in the notifications
+   */
+  if ((g_strcmp0 (name, "Xfce Notify Daemon") == 0) &&
+      (g_strcmp0 (vendor, "Xfce") == 0))
+    {
+      server_caps [CAP_BODY_HYPERLINKS] = FALSE;
+    }
+
+  /*
+   * some notification servers implementations may only show the summary,
+   * if server supports body text, let's append it to the notification
+   */
+  if (server_caps [CAP_BODY])
+    {
+      g_string_append_printf (body, "%sRepository:%s\t %s%s", bold, bold_end, notif->repository, newline);
+      g_string_append_printf (body, "%sType:%s\t\t %s%s", bold, bold_end, notif->type, newline);
+      g_string_append_printf (body, "%sTitle:%s\t\t %s%s", bold, bold_end, notif->title, newline);
+
+      /* author is not known until lazy enrichment */
+      if (notif->user)
+        g_string_append_printf (body, "%sUser:%s\t\t %s", bold, bold_end, notif->user);
+      else
+        g_string_append_printf (body, "%sReason:%s\t %s", bold, bold_end, notif->reason);
+
+      /* check whether server supports hyperlinks in the notifications */
+      if (server_caps [CAP_BODY_HYPERLINKS])
+        {
+          g_string_append_printf (body, "%s%sLink:%s\t\t <a href=%s>Link to Repository</a>",
+                                  newline, bold, bold_end, notif->repository_url);
+        }
+    }
+
+  /* create new notification */
+  notif_to_show = notify_notification_new (SUMMARY, body->str, notif->user_avatar);
+
+  /* persistent/transient */
+  if (!opt_persistent)
+    notify_notification_set_hint (notif_to_show, "transient", g_variant_new_boolean (TRUE));
+  else
+    if (!server_caps [CAP_PERSISTENCE])
+      print_log (LOG_INFO, "notification server doesn't support persistent notifications\n");
+
+  /* timeout and urgency */
+  notify_notification_set_timeout (notif_to_show, NOTIFY_EXPIRES_DEFAULT);
+  notify_notification_set_urgency (notif_to_show, NOTIFY_URGENCY_NORMAL);
+
+  /* open the thread or mark it as read straight from the popup */
+  with_actions = add_thread_actions (notif_to_show, notif);
+
+  /* finally we can show notification */
+  if (notify_notification_show (notif_to_show, NULL))
+    thread_shown (notif, NULL);
+
+  /* it's time to clean up - with actions, once the popup is closed */
+  g_string_free (body, TRUE);
+  if (!with_actions)
+    g_object_unref (G_OBJECT(notif_to_show));
+
+  PROBE (show_notification__return, notif->html_url, with_actions, g_get_monotonic_time () - started);
+  trace_end (span, notif->repository);
+}
+
+
+/*
+ * show one compact notification instead of a burst of popups
+ */
+static void
+show_digest (GList        *notifications_list,
+             const gchar  *when)
+{
+  NotifyNotification *digest;
+  notification *notif;
+  GString *body;
+  GList *iter;
+  gchar *summary, *title;
+  const gchar *newline;
+  guint count, lines;
+
+  count = g_list_length (notifications_list);
+  if (count == 0)
+    return;
+
+  body = g_string_new (NULL);
+  newline = server_newline ();
+  summary = g_strdup_printf ("You have received %u new GitHub Notifications %s", count, when);
+
+  if (server_caps [CAP_BODY])
+    {
+      lines = 0;
+      for (iter = notifications_list; iter && (lines < DIGEST_MAX_LINES); iter = iter->next, lines++)
+        {
+          notif = (notification*) iter->data;
+
+          if (server_caps [CAP_BODY_MARKUP])
+            {
+              title = g_markup_escape_text (notif->title, -1);
+              g_string_append_printf (body, "%s%s:%s %s (%s)%s", TAG_BOLD, notif->repository, TAG_BOLD_END,
+                                      title, notif->reason, iter->next ? newline : "");
+              g_free (title);
+            }
+          else
+            g_string_append_printf (body, "%s: %s (%s)%s", notif->repository, notif->title,
+                                    notif->reason, iter->next ? newline : "");
+        }
+
+      if (count > lines)
+        g_string_append_printf (body, "... and %u more", count - lines);
+    }
+
+  print_log (LOG_INFO, "digest notification: count=%u\n", count);
+
+  digest = notify_notification_new (summary, body->str, NULL);
+  notify_notification_set_timeout (digest, NOTIFY_EXPIRES_DEFAULT);
+  notify_notification_set_urgency (digest, NOTIFY_URGENCY_NORMAL);
+  if (notify_notification_show (digest, NULL))
+    g_list_foreach (notifications_list, thread_shown, NULL);
+
+  g_object_unref (G_OBJECT(digest));
+  g_string_free (body, TRUE);
+  g_free (summary);
+}
+
+
+/*
  * free notification
  */
 static void
-free_notification (gpointer data,
-                   gpointer user_data)
+free_notification (gpointer data,
+                   gpointer user_data)
+{
+  notification *notif;
+  notif = (notification*) data;
+
+  g_free (notif->repository);
+  g_free (notif->repository_url);
+  g_free (notif->repository_api_url);
+  g_free (notif->html_url);
+  g_free (notif->type);
+  g_free (notif->title);
+  g_free (notif->user);
+  g_free (notif->user_avatar);
+  g_free (notif->reason);
+  g_free (notif->id);
+  g_free (notif->updated_at);
+  g_free (notif->comment_url);
+  g_free (notif->avatar_url);
+
+  if (notif->transfer)
+    http_transfer_free (notif->transfer);
+
+  g_free (notif);
+}
+
+
+/*
+ * read comment author from 'latest_comment_url' response
+ */
+static gboolean
+read_comment_author (notification *notif)
+{
+  http_transfer *transfer;
+  json_t *json_local_root, *json_user, *json_obj;
+  json_error_t json_error;
+
+  transfer = notif->transfer;
+
+  if (transfer->short_circuited || transfer->negative_hit)
+    return FALSE;
+
+  /* the caller keeps these for later and reports them once */
+  if (transfer->deferred || transfer->rate_limited)
+    return FALSE;
+
+  if (transfer->status != CURLE_OK)
+    {
+      print_log (LOG_ERR, "curl_easy_perform() failed: %s\n", curl_easy_strerror(transfer->status));
+      return FALSE;
+    }
+
+  if (transfer->code != RESPONSE_CODE_OK)
+    {
+      print_log (LOG_ERR, "curl request error: server responded with code %ld\n", transfer->code);
+      return FALSE;
+    }
+
+  json_local_root = json_loads (transfer->chunk.data, 0, &json_error);
+  if (!json_local_root)
+    {
+      print_log (LOG_ERR, "JSON error: on line %d: %s\n", json_error.line, json_error.text);
+      negative_cache_add (transfer->url, transfer->code, NEGATIVE_TTL_INVALID);
+      return FALSE;
+    }
+
+  json_user = json_object_get (json_local_root, "user");
+  if (!json_is_object (json_user))
+    goto error;
+
+  /* read user login */
+  json_obj = json_object_get (json_user, "login");
+  if (json_is_string (json_obj))
+    notif->user = g_strdup (json_string_value (json_obj));
+  else
+    goto error;
+
+  /* read user ID */
+  json_obj = json_object_get (json_user, "id");
+  if (json_is_number (json_obj))
+    notif->user_id = (guint32) json_number_value (json_obj);
+  else
+    goto error;
+
+  /* comment link for the 'Open' action */
+  json_obj = json_object_get (json_local_root, "html_url");
+  if (json_is_string (json_obj))
+    notif->html_url = g_strdup (json_string_value (json_obj));
+
+  /* read url to avatar */
+  if (!opt_no_avatar)
+    {
+      json_obj = json_object_get (json_user, "avatar_url");
+      if (json_is_string (json_obj))
+        notif->avatar_url = g_strdup (json_string_value (json_obj));
+      else
+        goto error;
+    }
+
+  json_decref (json_local_root);
+  return TRUE;
+
+error:
+
+  /* payload failed validation - don't ask for it again soon */
+  negative_cache_add (transfer->url, transfer->code, NEGATIVE_TTL_INVALID);
+
+  json_decref (json_local_root);
+  return FALSE;
+}
+
+
+/*
+ * put back notifications paused by rate limiting, unless
+ * the latest poll already returned them again
+ */
+static gint
+compare_comment_url (gconstpointer a,
+                     gconstpointer b)
+{
+  return g_strcmp0 (((const notification*) a)->comment_url, ((const notification*) b)->comment_url);
+}
+
+static GList *
+resume_deferred_notifications (GList *notifications_list)
+{
+  GList *iter;
+  notification *notif;
+
+  for (iter = deferred_notifications; iter; iter = iter->next)
+    {
+      notif = (notification*) iter->data;
+
+      if (g_list_find_custom (notifications_list, notif, compare_comment_url))
+        free_notification (notif, NULL);
+      else
+        notifications_list = g_list_append (notifications_list, notif);
+    }
+
+  g_list_free (deferred_notifications);
+  deferred_notifications = NULL;
+
+  return notifications_list;
+}
+
+
+/*
+ * let's request some additional info: user name and user avatar,
+ * both requests fan out with the AIMD concurrency window,
+ * threads paused by rate limiting go to 'deferred' or are dropped
+ */
+static GList *
+enrich_notifications (GList   *notifications_list,
+                      GList  **deferred)
+{
+  GPtrArray *transfers;
+  GHashTable *users;
+  GList *iter, *next;
+  notification *notif;
+  trace_span *span;
+  gint64 started G_GNUC_UNUSED;
+  guint postponed;
+  gchar *path;
+
+  /* request latest comments */
+  transfers = g_ptr_array_new ();
+  for (iter = notifications_list; iter; iter = iter->next)
+    {
+      notif = (notification*) iter->data;
+      notif->transfer = http_transfer_new (notif->comment_url, TRUE, FALSE);
+      if (notif->transfer)
+        g_ptr_array_add (transfers, notif->transfer);
+    }
+
+  http_perform_many (transfers);
+  g_ptr_array_free (transfers, TRUE);
+
+  postponed = 0;
+  for (iter = notifications_list; iter; iter = next)
+    {
+      next = iter->next;
+      notif = (notification*) iter->data;
+
+      if (notif->transfer && read_comment_author (notif))
+        {
+          http_transfer_free (notif->transfer);
+          notif->transfer = NULL;
+          continue;
+        }
+
+      /* paused by rate limiting - retry in the next cycle */
+      if (deferred && notif->transfer && (notif->transfer->deferred || notif->transfer->rate_limited))
+        {
+          http_transfer_free (notif->transfer);
+          notif->transfer = NULL;
+          *deferred = g_list_append (*deferred, notif);
+          notifications_list = g_list_delete_link (notifications_list, iter);
+          postponed++;
+          continue;
+        }
+
+      /* upss... something goes wrong */
+      print_log (LOG_INFO, "invalid notification - %p\n", notif);
+      free_notification (notif, NULL);
+      notifications_list = g_list_delete_link (notifications_list, iter);
+    }
+
+  if (postponed)
+    print_log (LOG_INFO, "%u notification(s) deferred to the next cycle by rate limiting\n", postponed);
+
+  if (opt_no_avatar)
+    return notifications_list;
+
+  /* request avatars which are not downloaded yet, once per user */
+  transfers = g_ptr_array_new ();
+  users = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (iter = notifications_list; iter; iter = iter->next)
+    {
+      notif = (notification*) iter->data;
+
+      path = avatar_lookup (notif->user_id, notif->avatar_url);
+      if (path)
+        {
+          notif->user_avatar = path;
+          continue;
+        }
+
+      if (g_hash_table_contains (users, GUINT_TO_POINTER (notif->user_id)))
+        continue;
+      g_hash_table_add (users, GUINT_TO_POINTER (notif->user_id));
+
+      /* avatars are served by the CDN - don't pass the access token */
+      print_log (LOG_INFO, "downloading user avatar image\n");
+      notif->transfer = http_transfer_new (notif->avatar_url, FALSE, FALSE);
+      if (notif->transfer)
+        g_ptr_array_add (transfers, notif->transfer);
+    }
+
+  http_perform_many (transfers);
+  g_ptr_array_free (transfers, TRUE);
+
+  g_hash_table_destroy (users);
+
+  for (iter = notifications_list; iter; iter = iter->next)
+    {
+      notif = (notification*) iter->data;
+      if (notif->user_avatar)
+        continue;
+
+      /* no transfer - avatar was downloaded for another notification */
+      if (!notif->transfer)
+        {
+          notif->user_avatar = avatar_lookup (notif->user_id, notif->avatar_url);
+          continue;
+        }
+
+      span = trace_begin ("prepare_avatar", "enrich");
+      started = g_get_monotonic_time ();
+      PROBE (prepare_avatar__entry, notif->avatar_url, notif->user_id);
+      notif->user_avatar = prepare_avatar (notif->user_id, notif->avatar_url, notif->transfer);
+      PROBE (prepare_avatar__return, notif->avatar_url, notif->user_avatar != NULL,
+             notif->transfer->chunk.size, g_get_monotonic_time () - started);
+      trace_end (span, notif->avatar_url);
+      http_transfer_free (notif->transfer);
+      notif->transfer = NULL;
+    }
+
+  avatar_index_save ();
+
+  return notifications_list;
+}
+
+
+/*
+ * merge notifications into a backlog, newer ones replace
+ * older copies of the same thread
+ */
+static gint
+compare_thread_id (gconstpointer a,
+                   gconstpointer b)
+{
+  const notification *x, *y;
+
+  x = (const notification*) a;
+  y = (const notification*) b;
+
+  if (!x->id || !y->id)
+    return 1;
+
+  return g_strcmp0 (x->id, y->id);
+}
+
+/*
+ * approximate memory held by a queued notification
+ */
+static gsize
+notification_size (notification *notif)
+{
+  gchar *fields [] = { notif->repository, notif->repository_url, notif->repository_api_url,
+                       notif->html_url, notif->type, notif->title, notif->user,
+                       notif->user_avatar, notif->reason, notif->id, notif->updated_at,
+                       notif->comment_url, notif->avatar_url };
+  gsize size;
+  guint i;
+
+  size = sizeof (notification);
+  for (i = 0; i < G_N_ELEMENTS (fields); i++)
+    size += fields [i] ? strlen (fields [i]) + 1 : 0;
+
+  return size;
+}
+
+static GList*
+merge_backlog (GList   *backlog,
+               GList   *notifications_list,
+               guint    max_count,
+               gsize    max_bytes,
+               guint64 *dropped)
+{
+  GList *iter, *old;
+  notification *notif;
+  guint count;
+  gsize size;
+
+  for (iter = notifications_list; iter; iter = iter->next)
+    {
+      notif = (notification*) iter->data;
+
+      old = g_list_find_custom (backlog, notif, compare_thread_id);
+      if (old)
+        {
+          free_notification (old->data, NULL);
+          backlog = g_list_delete_link (backlog, old);
+        }
+
+      backlog = g_list_append (backlog, notif);
+    }
+
+  g_list_free (notifications_list);
+
+  count = 0;
+  size = 0;
+  for (iter = backlog; iter; iter = iter->next)
+    {
+      count++;
+      size += notification_size ((notification*) iter->data);
+    }
+
+  /* drop the oldest ones */
+  while (backlog && ((count > max_count) || (max_bytes && (size > max_bytes))))
+    {
+      count--;
+      size -= notification_size ((notification*) backlog->data);
+
+      free_notification (backlog->data, NULL);
+      backlog = g_list_delete_link (backlog, backlog);
+
+      if (dropped)
+        (*dropped)++;
+    }
+
+  return backlog;
+}
+
+
+/*
+ * notification store - current unread threads, published over D-Bus
+ */
+static void
+store_entry_free (gpointer data)
+{
+  store_entry *entry;
+
+  entry = (store_entry*) data;
+
+  g_free (entry->id);
+  g_free (entry->repository);
+  g_free (entry->type);
+  g_free (entry->title);
+  g_free (entry->reason);
+  g_free (entry->url);
+  g_free (entry->api_url);
+  g_free (entry->updated_at);
+  g_free (entry);
+}
+
+static GHashTable*
+store_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, NULL, store_entry_free);
+}
+
+static void
+store_insert (GHashTable    *snapshot,
+              notification  *notif)
+{
+  store_entry *entry;
+
+  if (!notif->id || g_hash_table_contains (snapshot, notif->id))
+    return;
+
+  if (g_hash_table_size (snapshot) >= STORE_MAX)
+    {
+      stats.store_dropped++;
+      return;
+    }
+
+  entry = g_new0 (store_entry, 1);
+  entry->id = g_strdup (notif->id);
+  entry->repository = g_strdup (notif->repository);
+  entry->type = g_strdup (notif->type);
+  entry->title = g_strdup (notif->title);
+  entry->reason = g_strdup (notif->reason);
+  entry->url = g_strdup (notif->repository_url);
+  entry->api_url = g_strdup (notif->repository_api_url);
+  entry->updated_at = g_strdup (notif->updated_at);
+
+  g_hash_table_insert (snapshot, entry->id, entry);
+}
+
+static gboolean
+store_differs (GHashTable *a,
+               GHashTable *b)
+{
+  GHashTableIter iter;
+  store_entry *entry, *other;
+
+  if (g_hash_table_size (a) != g_hash_table_size (b))
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, a);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &entry))
+    {
+      other = g_hash_table_lookup (b, entry->id);
+      if (!other ||
+          g_strcmp0 (entry->updated_at, other->updated_at) ||
+          g_strcmp0 (entry->reason, other->reason))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+store_changed (void)
+{
+  stats.store_changes++;
+
+  if (service_bus)
+    g_dbus_connection_emit_signal (service_bus, NULL, DBUS_PATH, DBUS_INTERFACE, "Changed",
+                                   g_variant_new ("(u)", g_hash_table_size (store)), NULL);
+}
+
+/*
+ * replace the store with a fresh snapshot, tell clients if anything changed
+ */
+static void
+store_replace (GHashTable *snapshot)
+{
+  if (!store_differs (store, snapshot))
+    {
+      g_hash_table_destroy (snapshot);
+      return;
+    }
+
+  g_hash_table_destroy (store);
+  store = snapshot;
+  store_changed ();
+}
+
+/*
+ * add or update threads from a partial snapshot, nothing is removed
+ */
+static void
+store_merge (GHashTable *snapshot)
+{
+  GHashTableIter iter;
+  store_entry *entry, *current;
+  gboolean changed;
+
+  changed = FALSE;
+
+  g_hash_table_iter_init (&iter, snapshot);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &entry))
+    {
+      current = g_hash_table_lookup (store, entry->id);
+      if (current &&
+          !g_strcmp0 (current->updated_at, entry->updated_at) &&
+          !g_strcmp0 (current->reason, entry->reason))
+        continue;
+
+      if (!current && (g_hash_table_size (store) >= STORE_MAX))
+        {
+          stats.store_dropped++;
+          continue;
+        }
+
+      g_hash_table_iter_steal (&iter);
+      g_hash_table_replace (store, entry->id, entry);
+      changed = TRUE;
+    }
+
+  g_hash_table_destroy (snapshot);
+
+  if (changed)
+    store_changed ();
+}
+
+/*
+ * threads marked as read from a popup are gone until a poll tells otherwise
+ */
+static gboolean
+store_remove_read (const gchar  *thread_id,
+                   const gchar  *repository)
+{
+  GHashTableIter iter;
+  store_entry *entry;
+  gboolean changed;
+
+  changed = FALSE;
+
+  if (thread_id)
+    changed = g_hash_table_remove (store, thread_id);
+  else
+    {
+      g_hash_table_iter_init (&iter, store);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &entry))
+        if (!g_strcmp0 (entry->api_url, repository))
+          {
+            g_hash_table_iter_remove (&iter);
+            changed = TRUE;
+          }
+    }
+
+  if (changed)
+    store_changed ();
+
+  return changed;
+}
+
+static GVariant*
+store_entry_to_variant (store_entry *entry)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "id", g_variant_new_string (entry->id));
+  g_variant_builder_add (&builder, "{sv}", "repository", g_variant_new_string (entry->repository));
+  g_variant_builder_add (&builder, "{sv}", "type", g_variant_new_string (entry->type));
+  g_variant_builder_add (&builder, "{sv}", "title", g_variant_new_string (entry->title));
+  g_variant_builder_add (&builder, "{sv}", "reason", g_variant_new_string (entry->reason));
+  g_variant_builder_add (&builder, "{sv}", "url", g_variant_new_string (entry->url));
+  if (entry->updated_at)
+    g_variant_builder_add (&builder, "{sv}", "updated_at", g_variant_new_string (entry->updated_at));
+
+  return g_variant_builder_end (&builder);
+}
+
+/*
+ * unread counts grouped by reason or by repository
+ */
+static GVariant*
+store_counts (gboolean by_reason)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  GHashTable *counts;
+  store_entry *entry;
+  gpointer key, value;
+
+  counts = g_hash_table_new (g_str_hash, g_str_equal);
+
+  g_hash_table_iter_init (&iter, store);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &entry))
+    {
+      key = by_reason ? entry->reason : entry->repository;
+      value = g_hash_table_lookup (counts, key);
+      g_hash_table_insert (counts, key, GUINT_TO_POINTER (GPOINTER_TO_UINT (value) + 1));
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{su}"));
+
+  g_hash_table_iter_init (&iter, counts);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&builder, "{su}", (gchar*) key, GPOINTER_TO_UINT (value));
+
+  g_hash_table_destroy (counts);
+
+  return g_variant_new ("(a{su})", &builder);
+}
+
+
+/*
+ * status snapshot - seqlock protected, status bars read it without
+ * any locking or syscalls
+ */
+static void
+status_write_begin (void)
+{
+  __atomic_store_n (&status_map->sequence, (status_map->sequence + 1) | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static void
+status_write_end (void)
+{
+  __atomic_store_n (&status_map->sequence, status_map->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void
+status_open (void)
+{
+  void *map;
+  int fd;
+
+  fd = open (opt_status_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      print_log (LOG_ERR, "cannot open status file '%s'\n", opt_status_file);
+      return;
+    }
+
+  /* existing file is reused, readers keep their mapping across restarts */
+  if (ftruncate (fd, sizeof (struct github_notifyd_status)) < 0)
+    {
+      print_log (LOG_ERR, "cannot resize status file '%s'\n", opt_status_file);
+      close (fd);
+      return;
+    }
+
+  map = mmap (NULL, sizeof (struct github_notifyd_status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (map == MAP_FAILED)
+    {
+      print_log (LOG_ERR, "cannot map status file '%s'\n", opt_status_file);
+      return;
+    }
+
+  status_map = (struct github_notifyd_status*) map;
+
+  status_write_begin ();
+  status_map->magic = GITHUB_NOTIFYD_STATUS_MAGIC;
+  status_map->version = GITHUB_NOTIFYD_STATUS_VERSION;
+  status_map->pid = getpid ();
+  status_map->unread = 0;
+  status_map->last_error_code = 0;
+  memset (status_map->reasons, 0, sizeof (status_map->reasons));
+  status_map->last_update = 0;
+  status_map->last_success = 0;
+  status_map->last_error_time = 0;
+  memset (status_map->last_error, 0, sizeof (status_map->last_error));
+  status_write_end ();
+}
+
+static void
+status_close (void)
+{
+  if (!status_map)
+    return;
+
+  status_write_begin ();
+  status_map->pid = 0;
+  status_write_end ();
+
+  munmap (status_map, sizeof (struct github_notifyd_status));
+  status_map = NULL;
+}
+
+static void
+status_publish (void)
+{
+  guint32 reasons [GITHUB_NOTIFYD_STATUS_REASONS];
+  GHashTableIter iter;
+  store_entry *entry;
+  trace_span *span;
+  guint i;
+
+  if (!status_map)
+    return;
+
+  span = trace_begin ("status_publish", "flush");
+
+  /* count outside of the write section, it stays as short as possible */
+  memset (reasons, 0, sizeof (reasons));
+
+  g_hash_table_iter_init (&iter, store);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &entry))
+    {
+      for (i = 0; i < GITHUB_NOTIFYD_STATUS_REASONS - 1; i++)
+        if (!g_strcmp0 (entry->reason, github_notifyd_status_reasons [i]))
+          break;
+      reasons [i]++;
+    }
+
+  status_write_begin ();
+  status_map->unread = g_hash_table_size (store);
+  memcpy (status_map->reasons, reasons, sizeof (reasons));
+  status_map->last_update = g_get_real_time () / G_USEC_PER_SEC;
+  status_map->last_success = poll_success;
+  status_map->last_error_time = poll_error_time;
+  status_map->last_error_code = poll_error_code;
+  g_strlcpy (status_map->last_error, poll_error ? poll_error : "", sizeof (status_map->last_error));
+  status_write_end ();
+
+  trace_end (span, NULL);
+}
+
+/*
+ * remember why the last poll failed
+ */
+static void
+record_poll_error (glong return_code)
+{
+  poll_error_code = return_code;
+  poll_error_time = g_get_real_time () / G_USEC_PER_SEC;
+
+  if (return_code == RESPONSE_CODE_CIRCUIT_OPEN)
+    poll_error = "API circuit open";
+  else if (return_code == RESPONSE_CODE_BACKOFF)
+    poll_error = "rate limited";
+  else if (return_code == RESPONSE_CODE_UNAUTHORIZED)
+    poll_error = "authorization error";
+  else if (return_code == RESPONSE_CODE_OK)
+    poll_error = "invalid response";
+  else
+    poll_error = "request failed";
+}
+
+
+/*
+ * lazy enrichment - only high priority threads are enriched up front
+ */
+static GList*
+enrich_eager_notifications (GList *notifications_list)
+{
+  GList *eager, *lazy, *iter;
+  notification *notif;
+
+  eager = NULL;
+  lazy = NULL;
+
+  for (iter = notifications_list; iter; iter = iter->next)
+    {
+      notif = (notification*) iter->data;
+
+      if (g_strv_contains ((const gchar * const *) eager_reasons, notif->reason))
+        eager = g_list_append (eager, notif);
+      else
+        {
+          lazy = g_list_append (lazy, notif);
+          stats.lazy_skipped++;
+        }
+    }
+
+  g_list_free (notifications_list);
+
+  return g_list_concat (enrich_notifications (eager, &deferred_notifications), lazy);
+}
+
+
+/*
+ * SIGUSR1 - dump of the internal state for "notifications are slow" reports
+ */
+static gdouble
+histogram_percentile (histogram  *h,
+                      guint       percentile)
+{
+  guint64 rank, seen;
+  guint i;
+
+  /* upper bound of the bucket with the sample, -1 past the last one */
+  rank = (h->count * percentile + 99) / 100;
+  seen = 0;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      seen += h->buckets[i];
+      if (seen >= rank)
+        return h->bounds[i];
+    }
+
+  return -1;
+}
+
+static GString *
+state_dump (void)
+{
+  static const guint percentiles[] = { 50, 90, 99 };
+  GHashTableIter iter;
+  GDateTime *now_local;
+  GString *dump;
+  host_state *host;
+  poll_lane *lane;
+  gpointer value;
+  gchar *timestamp;
+  guint64 lookups;
+  gdouble bound;
+  gint64 now;
+  guint i, p;
+
+  dump = g_string_new (NULL);
+  now = g_get_monotonic_time ();
+  lookups = stats.cache_hits + stats.cache_stale + stats.cache_misses;
+
+  now_local = g_date_time_new_now_local ();
+  timestamp = g_date_time_format (now_local, "%Y-%m-%d %H:%M:%S");
+  g_string_append_printf (dump, "github-notifyd state at %s (pid %d)\n", timestamp, (gint) getpid ());
+  g_free (timestamp);
+  g_date_time_unref (now_local);
+
+  g_string_append (dump, "scheduler:\n");
+  for (i = 0; i < LANES; i++)
+    {
+      lane = &lanes [i];
+      if (!lane->enabled)
+        {
+          g_string_append_printf (dump, "  lane %s: disabled\n", lane->name);
+          continue;
+        }
+
+      g_string_append_printf (dump, "  lane %s: interval=%us polls=%" G_GUINT64_FORMAT " ",
+                              lane->name, *lane->interval, lane->polls);
+      if (lane->source)
+        g_string_append_printf (dump, "next_poll=%" G_GINT64_FORMAT "s\n", MAX (0, lane->next - now) / G_USEC_PER_SEC);
+      else
+        g_string_append (dump, "next_poll=running\n");
+    }
+  g_string_append_printf (dump, "  user_idle=%d dnd=%d catch_up=%d watched_repositories=%u\n",
+                          user_idle, dnd_active, catch_up, watched_repos ? watched_repos->len : 0);
+  g_string_append_printf (dump, "  loop_stalls=%" G_GUINT64_FORMAT " lag_p99<=%gs\n",
+                          __atomic_load_n (&stats.loop_stalls, __ATOMIC_RELAXED),
+                          stats.loop_lag.count ? histogram_percentile (&stats.loop_lag, 99) : 0);
+
+  g_string_append (dump, "requests:\n");
+  g_string_append_printf (dump, "  in_flight=%u total=%" G_GUINT64_FORMAT " window=%.1f max_in_flight=%u\n",
+                          http_in_flight, stats.requests, concurrency.window, concurrency.max_in_flight);
+  g_string_append_printf (dump, "  first_byte_ms p50=%u p95=%u p99=%u hedge_threshold=%u\n",
+                          first_byte_percentile (50), first_byte_percentile (95),
+                          first_byte_percentile (99), hedge_threshold ());
+
+  g_string_append (dump, "caches:\n");
+  g_string_append_printf (dump, "  http entries=%u bytes=%" G_GSIZE_FORMAT "/%u hit=%.2f stale=%.2f miss=%.2f\n",
+                          http_cache ? g_hash_table_size (http_cache) : 0, http_cache_size, opt_cache_size * 1024,
+                          lookups ? (gdouble) stats.cache_hits / lookups : 0,
+                          lookups ? (gdouble) stats.cache_stale / lookups : 0,
+                          lookups ? (gdouble) stats.cache_misses / lookups : 0);
+  g_string_append_printf (dump, "  negative entries=%u hits=%" G_GUINT64_FORMAT "\n",
+                          negative_cache ? g_hash_table_size (negative_cache) : 0, stats.negative_hits);
+  g_string_append_printf (dump, "  avatars entries=%u\n", avatar_index ? g_hash_table_size (avatar_index) : 0);
+  g_string_append_printf (dump, "  store=%u shown_threads=%u deferred=%u idle_backlog=%u dnd_queue=%u\n",
+                          store ? g_hash_table_size (store) : 0,
+                          shown_threads ? g_hash_table_size (shown_threads) : 0,
+                          g_list_length (deferred_notifications), g_list_length (idle_backlog),
+                          g_list_length (dnd_queue));
+
+  g_string_append (dump, "hosts:\n");
+  g_hash_table_iter_init (&iter, hosts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      host = (host_state*) value;
+      g_string_append_printf (dump, "  %s breaker=%s failures=%u backoff=%us ratelimit_remaining=%" G_GINT64_FORMAT,
+                              host->name, breaker_names[host->breaker], host->failures,
+                              host_backoff_remaining (host), host->ratelimit_remaining);
+      if (host->ratelimit_remaining >= 0)
+        g_string_append_printf (dump, " reset_in=%" G_GINT64_FORMAT "s",
+                                MAX (0, host->ratelimit_reset - g_get_real_time () / G_USEC_PER_SEC));
+      g_string_append (dump, "\n");
+    }
+
+  g_string_append (dump, "time to notify [s]:\n");
+  for (i = 0; i < TTN_LAST; i++)
+    {
+      g_string_append_printf (dump, "  %s count=%" G_GUINT64_FORMAT, ttn_stages[i], stats.ttn[i].count);
+      for (p = 0; p < G_N_ELEMENTS (percentiles) && stats.ttn[i].count; p++)
+        {
+          bound = histogram_percentile (&stats.ttn[i], percentiles[p]);
+          if (bound < 0)
+            g_string_append_printf (dump, " p%u>%g", percentiles[p], ttn_buckets[HISTOGRAM_BUCKETS - 1]);
+          else
+            g_string_append_printf (dump, " p%u<=%g", percentiles[p], bound);
+        }
+      g_string_append (dump, "\n");
+    }
+
+  return dump;
+}
+
+static void
+state_dump_written (GObject       *source,
+                    GAsyncResult  *result,
+                    gpointer       user_data)
+{
+  GError *error;
+
+  error = NULL;
+  if (!g_file_replace_contents_finish (G_FILE (source), result, NULL, &error))
+    {
+      print_log (LOG_ERR, "cannot write state dump: %s\n", error->message);
+      g_error_free (error);
+    }
+
+  g_free (user_data);
+  g_object_unref (source);
+}
+
+/*
+ * the signal only sets a flag and wakes the loop through a pipe - the dump is
+ * taken by the main loop between cycles or by http_wait in the middle of one
+ */
+static void
+sigusr1_handler (gint signum)
+{
+  gint saved_errno;
+
+  saved_errno = errno;
+  dump_requested = 1;
+  if (write (dump_pipe[1], "", 1) < 0)
+    {
+      /* pipe is full - a wakeup is pending anyway */
+    }
+  errno = saved_errno;
+}
+
+static void
+dump_service (void)
+{
+  GString *dump;
+  GFile *file;
+  gchar *path, *contents, drain[64];
+  gsize length;
+
+  if (!dump_requested)
+    return;
+
+  dump_requested = 0;
+  while (read (dump_pipe[0], drain, sizeof (drain)) > 0);
+
+  dump = state_dump ();
+  print_log (LOG_INFO, "%s", dump->str);
+
+  /* the file is written by GIO's worker thread - the loop goes on meanwhile */
+  path = g_build_filename (g_get_user_runtime_dir (), DUMP_FILE, NULL);
+  file = g_file_new_for_path (path);
+  g_free (path);
+
+  length = dump->len;
+  contents = g_string_free (dump, FALSE);
+  g_file_replace_contents_async (file, contents, length, NULL, FALSE,
+                                 G_FILE_CREATE_REPLACE_DESTINATION, NULL, state_dump_written, contents);
+}
+
+static gboolean
+dump_pipe_ready (gint          fd,
+                 GIOCondition  condition,
+                 gpointer      user_data)
+{
+  dump_service ();
+  return TRUE;
+}
+
+
+/*
+ * cross-lane dedupe - a thread is shown once per update,
+ * no matter which lane saw it first
+ */
+static gboolean
+thread_is_pending (GList         *list,
+                   notification  *notif)
+{
+  notification *other;
+
+  for (; list; list = list->next)
+    {
+      other = (notification*) list->data;
+      if (!g_strcmp0 (other->id, notif->id) && (g_strcmp0 (other->updated_at, notif->updated_at) >= 0))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+thread_is_new (notification *notif)
+{
+  const gchar *shown;
+
+  if (!notif->id || !notif->updated_at)
+    return TRUE;
+
+  shown = g_hash_table_lookup (shown_threads, notif->id);
+  if (shown && (g_strcmp0 (shown, notif->updated_at) >= 0))
+    return FALSE;
+
+  /* the other lane got it first, it waits for enrichment or for the user */
+  return !thread_is_pending (deferred_notifications, notif) &&
+         !thread_is_pending (idle_backlog, notif) &&
+         !thread_is_pending (dnd_queue, notif);
+}
+
+/*
+ * a shown thread missing from the feed was read - unless it's older
+ * than the last fetched page and the feed didn't reach it
+ */
+static gboolean
+thread_is_read (gpointer key,
+                gpointer value,
+                gpointer user_data)
+{
+  const gchar *oldest;
+
+  oldest = (const gchar*) user_data;
+  if (oldest && (g_strcmp0 ((const gchar*) value, oldest) < 0))
+    return FALSE;
+
+  return !g_hash_table_contains (store, key);
+}
+
+static gchar *
+store_oldest (GHashTable *snapshot)
+{
+  GHashTableIter iter;
+  store_entry *entry;
+  const gchar *oldest;
+
+  oldest = NULL;
+
+  g_hash_table_iter_init (&iter, snapshot);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &entry))
+    if (entry->updated_at && (!oldest || (strcmp (entry->updated_at, oldest) < 0)))
+      oldest = entry->updated_at;
+
+  return g_strdup (oldest);
+}
+
+
+/*
+ * complete feed - the API returns 50 threads per page,
+ * the rest is reached through 'Link: <...>; rel="next"'
+ */
+static gboolean
+fetch_next_pages (json_t    *json_root,
+                  gboolean  *truncated)
+{
+  json_error_t json_error;
+  json_t *json_page;
+  gchar *url, *curl_response;
+  glong return_code;
+  guint pages;
+
+  *truncated = FALSE;
+
+  for (pages = 1; next_page; pages++)
+    {
+      /* the store can't keep more anyway */
+      if (pages >= FEED_MAX_PAGES)
+        {
+          print_log (LOG_INFO, "notification feed truncated at %u threads\n", (guint) json_array_size (json_root));
+          g_free (next_page);
+          next_page = NULL;
+          *truncated = TRUE;
+          break;
+        }
+
+      url = next_page;
+      next_page = NULL;
+      curl_response = curl_request (url, FALSE, &return_code);
+      g_free (url);
+
+      if (!curl_response)
+        return FALSE;
+
+      json_page = json_loads (curl_response, 0, &json_error);
+      g_free (curl_response);
+
+      if (!json_is_array (json_page))
+        {
+          print_log (LOG_ERR, "JSON error: page of the notification feed is not an array\n");
+          json_decref (json_page);
+          return FALSE;
+        }
+
+      json_array_extend (json_root, json_page);
+      json_decref (json_page);
+    }
+
+  return TRUE;
+}
+
+
+/*
+ * check GitHub notifications status
+ */
+static gboolean
+check_github_notifications (gpointer user_data)
+{
+  NotifyNotification *error;
+  GList *notifications_list, *iter;
+  GHashTable *snapshot;
+  notification *notif;
+  poll_lane *lane;
+  GDateTime *updated;
+  gint64 polled, fetched, enriched, delivering;
+  gint64 started G_GNUC_UNUSED;
+  trace_span *span;
+  json_t *json_root;
+  json_error_t json_error;
+  gchar *curl_response, *oldest;
+  gboolean complete, truncated;
+  guint json_cnt;
+  glong return_code;
+
+  lane = (poll_lane*) user_data;
+  error = NULL;
+  notifications_list = NULL;
+  snapshot = NULL;
+  json_root = NULL;
+  curl_response = NULL;
+
+  /* list all notifications */
+  polled = g_get_real_time ();
+  curl_response = curl_request (lane->url, TRUE, &return_code);
+  fetched = g_get_real_time ();
+  if (curl_response == NULL)
+    goto error;
+
+  /* decode received JSON string */
+  span = trace_begin ("parse", "poll");
+  PROBE (json_decode__entry, lane->url, strlen (curl_response));
+  started = g_get_monotonic_time ();
+  json_root = json_loads (curl_response, 0, &json_error);
+  PROBE (json_decode__return, lane->url, json_root != NULL, json_array_size (json_root), g_get_monotonic_time () - started);
+  g_free (curl_response);
+
+  if (!json_root)
+    {
+      print_log (LOG_ERR, "JSON error: on line %d: %s\n", json_error.line, json_error.text);
+      trace_end (span, NULL);
+      goto error;
+    }
+
+  if (!json_is_array(json_root))
+    {
+      print_log (LOG_ERR, "JSON error: root is not an array\n");
+      json_decref (json_root);
+      trace_end (span, NULL);
+      goto error;
+    }
+
+  /* only the participating lane can do with the first page */
+  complete = TRUE;
+  truncated = FALSE;
+  if (lane->full)
+    {
+      complete = fetch_next_pages (json_root, &truncated);
+      fetched = g_get_real_time ();
+    }
+
+  /* iterate over notifications array */
+  snapshot = store_new ();
+  for (json_cnt = 0; json_cnt < json_array_size (json_root); ++json_cnt)
+    {
+      json_t *json_notification, *json_obj;
+      json_t *json_subject, *json_repository;
+
+      json_notification = NULL;
+      json_obj = NULL;
+      json_subject = NULL;
+      json_repository = NULL;
+
+      /* allocate memory for new notification */
+      notif = g_new0 (notification, 1);
+
+      json_notification = json_array_get (json_root, json_cnt);
+      if (!json_is_object (json_notification))
+        goto skip;
+
+      /* read thread ID */
+      json_obj = json_object_get (json_notification, "id");
+      if (json_is_string (json_obj))
+        notif->id = g_strdup (json_string_value (json_obj));
+
+      /* read notification reason */
+      json_obj = json_object_get (json_notification, "reason");
+      if (json_is_string (json_obj))
+        notif->reason = g_strdup (json_string_value (json_obj));
+      else
+        goto skip;
+
+      /* read notification subject */
+      json_subject = json_object_get (json_notification, "subject");
+      if (!json_is_object (json_subject))
+        goto skip;
+
+      /* read notification type */
+      json_obj = json_object_get (json_subject, "type");
+      if (json_is_string (json_obj))
+        notif->type = g_strdup (json_string_value (json_obj));
+      else
+        goto skip;
+
+      /* read notification title */
+      json_obj = json_object_get (json_subject, "title");
+      if (json_is_string (json_obj))
+        notif->title = g_strdup (json_string_value (json_obj));
+      else
+        goto skip;
+
+      json_repository = json_object_get (json_notification, "repository");
+      if (!json_is_object (json_repository))
+        goto skip;
+
+      /* read reposiotry name */
+      json_obj = json_object_get (json_repository, "name");
+      if (json_is_string (json_obj))
+        notif->repository = g_strdup (json_string_value (json_obj));
+      else
+        goto skip;
+
+      /* read url to repository */
+      json_obj = json_object_get (json_repository, "html_url");
+      if (json_is_string (json_obj))
+        notif->repository_url = g_strdup (json_string_value (json_obj));
+      else
+        goto skip;
+
+      /* repository API url - for 'Mark repo read' */
+      json_obj = json_object_get (json_repository, "url");
+      if (json_is_string (json_obj))
+        notif->repository_api_url = g_strdup (json_string_value (json_obj));
+
+      /* read time of the last update */
+      json_obj = json_object_get (json_notification, "updated_at");
+      if (json_is_string (json_obj))
+        notif->updated_at = g_strdup (json_string_value (json_obj));
+
+      /* start of the time-to-notify */
+      updated = notif->updated_at ? g_date_time_new_from_iso8601 (notif->updated_at, NULL) : NULL;
+      if (updated)
+        {
+          notif->updated = g_date_time_to_unix (updated) * G_USEC_PER_SEC;
+          g_date_time_unref (updated);
+        }
+      notif->polled = polled;
+      notif->fetched = fetched;
+
+      /* every unread thread is published, popups need a comment */
+      store_insert (snapshot, notif);
+
+      /* comment author and avatar are requested later */
+      json_obj = json_object_get (json_subject, "latest_comment_url");
+      if (json_is_string (json_obj))
+        notif->comment_url = g_strdup (json_string_value (json_obj));
+      else
+        goto skip;
+
+      /* shown already by this or the other lane */
+      if (!thread_is_new (notif))
+        {
+          stats.duplicates++;
+          free_notification (notif, NULL);
+          continue;
+        }
+
+      notifications_list = g_list_append (notifications_list, notif);
+      continue;
+
+skip:
+      /* upss... something goes wrong */
+      print_log (LOG_INFO, "invalid notification - %p\n", notif);
+      free_notification (notif, NULL);
+      continue;
+    }
+
+  json_decref (json_root);
+  trace_end (span, NULL);
+
+  /* only the complete feed tells which threads were read */
+  if (lane->full && complete)
+    {
+      oldest = truncated ? store_oldest (snapshot) : NULL;
+      store_replace (snapshot);
+      g_hash_table_foreach_remove (shown_threads, thread_is_read, oldest);
+      g_free (oldest);
+    }
+  else
+    store_merge (snapshot);
+  poll_success = g_get_real_time () / G_USEC_PER_SEC;
+
+deliver:
+
+  /* requests paused by rate limiting in previous cycles */
+  notifications_list = resume_deferred_notifications (notifications_list);
+
+  /* nobody would see popups, or the catch-up digest isn't complete yet */
+  if (user_idle || catch_up)
+    {
+      if (user_idle)
+        stats.idle_polls++;
+      idle_backlog = merge_backlog (idle_backlog, notifications_list, IDLE_BACKLOG_MAX, 0, NULL);
+
+      metrics_write ();
+      return TRUE;
+    }
+
+  /* notification server is in do-not-disturb mode - queue for the digest */
+  if (dnd_active)
+    {
+      dnd_queue = merge_backlog (dnd_queue, notifications_list, DND_QUEUE_MAX,
+                                 (gsize) opt_dnd_queue_size * 1024, &stats.dnd_dropped);
+
+      metrics_write ();
+      return TRUE;
+    }
+
+  /* fetch comment authors and avatars */
+  span = trace_begin ("enrich", "enrich");
+  if (opt_lazy)
+    notifications_list = enrich_eager_notifications (notifications_list);
+  else
+    notifications_list = enrich_notifications (notifications_list, &deferred_notifications);
+  trace_end (span, NULL);
+
+  /* log new notifications */
+  enriched = g_get_real_time ();
+  for (iter = notifications_list; iter; iter = iter->next)
+    {
+      notif = (notification*) iter->data;
+      print_log (LOG_INFO, "new notification: respository=%s type=%s reason=%s\n",
+                 notif->repository, notif->type, notif->reason);
+
+      /* for deferred ones, enrichment includes the wait for the next cycle */
+      notif->enriched = enriched;
+    }
+
+  /* show all received notifications - delivery of each one is timed on its own */
+  for (iter = notifications_list; iter; iter = iter->next)
+    {
+      delivering = g_get_real_time ();
+      show_notification (iter->data, NULL);
+      record_time_to_notify ((notification*) iter->data, delivering, g_get_real_time ());
+    }
+
+  /* clean up */
+  g_list_foreach (notifications_list, free_notification, NULL);
+  g_list_free (notifications_list);
+
+  metrics_write ();
+  return TRUE;
+
+error:
+
+  /* status bars show when and why the last poll failed */
+  if (return_code == RESPONSE_CODE_NOT_MODIFIED)
+    poll_success = g_get_real_time () / G_USEC_PER_SEC;
+  else
+    record_poll_error (return_code);
+
+  /*
+   * it's not error - we just don't have any new notifications to show,
+   * or API host circuit is open or rate limited and it was already logged
+   */
+  if ((return_code == RESPONSE_CODE_NOT_MODIFIED) ||
+      (return_code == RESPONSE_CODE_CIRCUIT_OPEN) ||
+      (return_code == RESPONSE_CODE_BACKOFF))
+    goto deliver;
+
+  /* show error notification */
+  if (return_code == RESPONSE_CODE_UNAUTHORIZED)
+    error = notify_notification_new ("'github-notifyd' authorization error - please check access token value", NULL, NULL);
+  else
+    error = notify_notification_new ("'github-notifyd' undefinded error - please check the logs for more information", NULL, NULL);
+
+  notify_notification_set_timeout (error, NOTIFY_EXPIRES_DEFAULT);
+  notify_notification_set_urgency (error, NOTIFY_URGENCY_CRITICAL);
+  notify_notification_show (error, NULL);
+
+  g_object_unref (G_OBJECT(error));
+
+  metrics_write ();
+  return TRUE;
+}
+
+
+/*
+ * user is back - everything in one digest, without enrichment,
+ * shown once every lane has polled
+ */
+static void
+catch_up_finish (poll_lane *lane)
+{
+  guint i;
+
+  if (!lane->catch_up)
+    return;
+
+  lane->catch_up = FALSE;
+  for (i = 0; i < LANES; i++)
+    if (lanes [i].enabled && lanes [i].catch_up)
+      return;
+
+  catch_up = FALSE;
+
+  /* gone again - the backlog waits for the next catch-up */
+  if (user_idle)
+    return;
+
+  /* notification server is in do-not-disturb mode - it goes to the DND digest */
+  if (dnd_active)
+    {
+      dnd_queue = merge_backlog (dnd_queue, idle_backlog, DND_QUEUE_MAX,
+                                 (gsize) opt_dnd_queue_size * 1024, &stats.dnd_dropped);
+      idle_backlog = NULL;
+      return;
+    }
+
+  if (idle_backlog)
+    stats.catch_up_digests++;
+  show_digest (idle_backlog, "while you were away");
+
+  g_list_foreach (idle_backlog, free_notification, NULL);
+  g_list_free (idle_backlog);
+  idle_backlog = NULL;
+}
+
+
+/*
+ * open or verify the API connection, so the poll runs on a warm one
+ */
+static gboolean
+prewarm_connection (gpointer user_data)
+{
+  http_transfer *transfer;
+  poll_lane *lane;
+
+  lane = (poll_lane*) user_data;
+  lane->prewarm_source = 0;
+
+  /* rate limit endpoint doesn't count against the rate limit */
+  transfer = http_transfer_new (GITHUB_API_RATE_LIMIT, TRUE, FALSE);
+  if (!transfer)
+    return FALSE;
+
+  curl_easy_setopt (transfer->curl, CURLOPT_NOBODY, 1L);
+  transfer->cacheable = FALSE;
+  transfer->method = "HEAD";
+
+  if (http_perform (transfer, FALSE) == CURLE_OK)
+    {
+      stats.prewarms++;
+      if (transfer->reused)
+        stats.prewarms_reused++;
+
+      print_log (LOG_INFO, "API connection %s, next poll (%s) in %" G_GINT64_FORMAT "s\n",
+                 transfer->reused ? "still warm" : "re-established", lane->name,
+                 (lane->next - g_get_monotonic_time ()) / G_USEC_PER_SEC);
+    }
+
+  http_transfer_free (transfer);
+  return FALSE;
+}
+
+
+/*
+ * repository watch-list - events feeds of repositories the user
+ * doesn't get notifications for
+ */
+static void
+watched_repo_free (gpointer data)
+{
+  watched_repo *repo;
+
+  repo = (watched_repo*) data;
+
+  g_free (repo->name);
+  g_free (repo->url);
+  g_free (repo->etag);
+  g_free (repo->last_event);
+  g_free (repo);
+}
+
+static gboolean
+watch_add_repo (const gchar *name)
+{
+  watched_repo *repo;
+  gchar **parts;
+  gboolean valid;
+
+  parts = g_strsplit (name, "/", -1);
+  valid = (g_strv_length (parts) == 2) && *parts[0] && *parts[1] && !strpbrk (name, " ?#");
+  g_strfreev (parts);
+
+  if (!valid)
+    {
+      print_log (LOG_ERR, "invalid repository name '%s' - expected OWNER/REPO\n", name);
+      return FALSE;
+    }
+
+  repo = g_new0 (watched_repo, 1);
+  repo->name = g_strdup (name);
+  repo->url = g_strdup_printf ("%s%s/events?per_page=%d", GITHUB_API_REPOS, name, WATCH_PER_PAGE);
+
+  g_ptr_array_add (watched_repos, repo);
+  return TRUE;
+}
+
+/*
+ * event IDs are increasing decimal numbers of any length
+ */
+static gboolean
+event_newer (const gchar *id,
+             const gchar *than)
+{
+  gsize id_len, than_len;
+
+  if (!than)
+    return TRUE;
+
+  id_len = strlen (id);
+  than_len = strlen (than);
+
+  if (id_len != than_len)
+    return id_len > than_len;
+
+  return strcmp (id, than) > 0;
+}
+
+static notification *
+read_repo_event (watched_repo  *repo,
+                 json_t        *json_event)
+{
+  json_t *json_obj, *json_payload, *json_release;
+  notification *notif;
+  const gchar *type, *ref;
+
+  json_obj = json_object_get (json_event, "type");
+  if (!json_is_string (json_obj))
+    return NULL;
+
+  type = json_string_value (json_obj);
+  json_payload = json_object_get (json_event, "payload");
+  if (!json_is_object (json_payload))
+    return NULL;
+
+  notif = g_new0 (notification, 1);
+  notif->repository = g_strdup (repo->name);
+  notif->repository_url = g_strdup_printf ("%s%s", GITHUB_WEB, repo->name);
+  notif->reason = g_strdup ("watch");
+
+  json_obj = json_object_get (json_object_get (json_event, "actor"), "login");
+  notif->user = g_strdup (json_is_string (json_obj) ? json_string_value (json_obj) : "unknown");
+
+  if (!g_strcmp0 (type, "ReleaseEvent"))
+    {
+      json_release = json_object_get (json_payload, "release");
+
+      json_obj = json_object_get (json_release, "name");
+      if (!json_is_string (json_obj) || !*json_string_value (json_obj))
+        json_obj = json_object_get (json_release, "tag_name");
+      if (!json_is_string (json_obj))
+        goto skip;
+
+      notif->type = g_strdup ("Release");
+      notif->title = g_strdup (json_string_value (json_obj));
+    }
+  else if (!g_strcmp0 (type, "PushEvent"))
+    {
+      json_obj = json_object_get (json_payload, "ref");
+      if (!json_is_string (json_obj))
+        goto skip;
+
+      ref = json_string_value (json_obj);
+      if (g_str_has_prefix (ref, "refs/heads/"))
+        ref += strlen ("refs/heads/");
+
+      json_obj = json_object_get (json_payload, "size");
+      notif->type = g_strdup ("Push");
+      if (json_is_integer (json_obj))
+        notif->title = g_strdup_printf ("%" JSON_INTEGER_FORMAT " commit(s) to %s", json_integer_value (json_obj), ref);
+      else
+        notif->title = g_strdup_printf ("pushed to %s", ref);
+    }
+  else
+    goto skip;
+
+  return notif;
+
+skip:
+
+  /* not interesting or incomplete */
+  free_notification (notif, NULL);
+  return NULL;
+}
+
+static GList *
+read_repo_events (watched_repo   *repo,
+                  http_transfer  *transfer)
+{
+  GList *events_list;
+  json_t *json_root, *json_obj;
+  json_error_t json_error;
+  notification *notif;
+  const gchar *id, *newest;
+  gint i;
+
+  events_list = NULL;
+  newest = NULL;
+
+  json_root = json_loads (transfer->chunk.data, 0, &json_error);
+  if (!json_is_array (json_root))
+    {
+      print_log (LOG_ERR, "JSON error: events of %s are not an array\n", repo->name);
+      json_decref (json_root);
+      return NULL;
+    }
+
+  /* oldest first, so popups are shown in order */
+  for (i = json_array_size (json_root) - 1; i >= 0; i--)
+    {
+      json_obj = json_object_get (json_array_get (json_root, i), "id");
+      if (!json_is_string (json_obj))
+        continue;
+
+      id = json_string_value (json_obj);
+      if (!event_newer (id, repo->last_event))
+        continue;
+
+      newest = id;
+
+      /* first fetch only remembers where the feed is */
+      if (!repo->primed)
+        continue;
+
+      notif = read_repo_event (repo, json_array_get (json_root, i));
+      if (notif)
+        events_list = g_list_append (events_list, notif);
+    }
+
+  if (newest)
+    {
+      g_free (repo->last_event);
+      repo->last_event = g_strdup (newest);
+    }
+  repo->primed = TRUE;
+
+  json_decref (json_root);
+  return events_list;
+}
+
+static void
+deliver_repo_events (GList *events_list)
+{
+  if (!events_list)
+    return;
+
+  stats.watch_events += g_list_length (events_list);
+
+  /* same rules as for notifications - nothing pops up while nobody looks */
+  if (user_idle || catch_up)
+    {
+      idle_backlog = merge_backlog (idle_backlog, events_list, IDLE_BACKLOG_MAX, 0, NULL);
+      return;
+    }
+
+  if (dnd_active)
+    {
+      dnd_queue = merge_backlog (dnd_queue, events_list, DND_QUEUE_MAX,
+                                 (gsize) opt_dnd_queue_size * 1024, &stats.dnd_dropped);
+      return;
+    }
+
+  if (g_list_length (events_list) > WATCH_MAX_POPUPS)
+    show_digest (events_list, "in watched repositories");
+  else
+    g_list_foreach (events_list, show_notification, NULL);
+
+  g_list_foreach (events_list, free_notification, NULL);
+  g_list_free (events_list);
+}
+
+/*
+ * token bucket - requests are spread evenly over the interval,
+ * a stalled main loop can't turn into a burst bigger than the bucket
+ */
+static gboolean
+watch_tick (gpointer user_data)
+{
+  GPtrArray *transfers, *repos;
+  GList *events_list;
+  http_transfer *transfer;
+  watched_repo *repo;
+  gchar *header;
+  gdouble rate;
+  gint64 now;
+  guint i, visited;
+
+  watch_source = 0;
+
+  now = g_get_monotonic_time ();
+  rate = (gdouble) watched_repos->len / (user_idle ? MAX (opt_idle_interval, opt_watch_interval) : opt_watch_interval);
+
+  watch_bucket.tokens = MIN ((gdouble) WATCH_BUCKET_SIZE,
+                             watch_bucket.tokens + rate * (now - watch_bucket.refilled) / G_USEC_PER_SEC);
+  watch_bucket.refilled = now;
+
+  transfers = g_ptr_array_new ();
+  repos = g_ptr_array_new ();
+  events_list = NULL;
+
+  /* round robin, one token per request */
+  for (visited = 0; (watch_bucket.tokens >= 1.0) && (visited < watched_repos->len); visited++)
+    {
+      repo = g_ptr_array_index (watched_repos, watch_next);
+      watch_next = (watch_next + 1) % watched_repos->len;
+
+      if (repo->disabled)
+        continue;
+
+      transfer = http_transfer_new (repo->url, TRUE, FALSE);
+      if (!transfer)
+        continue;
+
+      /* ETags are kept per repository, events don't fit into the HTTP cache */
+      transfer->cacheable = FALSE;
+      if (repo->etag)
+        {
+          header = g_strdup_printf ("If-None-Match: %s", repo->etag);
+          transfer->headers = curl_slist_append (transfer->headers, header);
+          curl_easy_setopt (transfer->curl, CURLOPT_HTTPHEADER, transfer->headers);
+          g_free (header);
+        }
+
+      g_ptr_array_add (transfers, transfer);
+      g_ptr_array_add (repos, repo);
+      watch_bucket.tokens -= 1.0;
+    }
+
+  http_perform_many (transfers);
+
+  for (i = 0; i < transfers->len; i++)
+    {
+      transfer = g_ptr_array_index (transfers, i);
+      repo = g_ptr_array_index (repos, i);
+
+      stats.watch_requests++;
+
+      if (transfer->status != CURLE_OK)
+        goto next;
+
+      switch (transfer->code)
+        {
+          case RESPONSE_CODE_NOT_MODIFIED:
+            stats.watch_not_modified++;
+            break;
+
+          case RESPONSE_CODE_OK:
+            g_free (repo->etag);
+            repo->etag = g_strdup (transfer->etag);
+            events_list = g_list_concat (events_list, read_repo_events (repo, transfer));
+            break;
+
+          case RESPONSE_CODE_NOT_FOUND:
+          case RESPONSE_CODE_GONE:
+            print_log (LOG_ERR, "watched repository %s doesn't exist - not watching it anymore\n", repo->name);
+            repo->disabled = TRUE;
+            break;
+
+          default:
+            if (transfer->code)
+              print_log (LOG_ERR, "cannot read events of %s: code %ld\n", repo->name, transfer->code);
+            break;
+        }
+
+next:
+      http_transfer_free (transfer);
+    }
+
+  g_ptr_array_free (transfers, TRUE);
+  g_ptr_array_free (repos, TRUE);
+
+  deliver_repo_events (events_list);
+
+  /* sleep until the next token */
+  for (i = 0; i < watched_repos->len; i++)
+    if (!((watched_repo*) g_ptr_array_index (watched_repos, i))->disabled)
+      break;
+
+  if (i < watched_repos->len)
+    watch_source = g_timeout_add ((guint) MAX (1.0, (1.0 - watch_bucket.tokens) / rate * 1000), watch_tick, NULL);
+
+  return FALSE;
+}
+
+static void
+watch_start (void)
+{
+  guint i;
+
+  watched_repos = g_ptr_array_new_with_free_func (watched_repo_free);
+  for (i = 0; opt_watch_repos [i]; i++)
+    watch_add_repo (opt_watch_repos [i]);
+
+  if (!watched_repos->len)
+    return;
+
+  print_log (LOG_INFO, "watching %u repositories, each every %usec\n", watched_repos->len, opt_watch_interval);
+
+  watch_bucket.tokens = 1.0;
+  watch_bucket.refilled = g_get_monotonic_time ();
+  watch_source = g_idle_add (watch_tick, NULL);
+}
+
+
+/*
+ * poll phase - every machine and user polls at its own stable offset
+ * within the interval, logins at the same time don't turn into
+ * synchronized waves of requests
+ */
+static void
+init_poll_phase (void)
 {
-  notification *notif;
-  notif = (notification*) data;
+  gchar *machine_id, *seed, *digest;
+  guint i;
+
+  machine_id = NULL;
+  if (!g_file_get_contents (MACHINE_ID_FILE, &machine_id, NULL, NULL))
+    g_file_get_contents (DBUS_MACHINE_ID_FILE, &machine_id, NULL, NULL);
+
+  for (i = 0; i < LANES; i++)
+    {
+      seed = g_strdup_printf ("%s:%u:%s", machine_id ? g_strstrip (machine_id) : g_get_host_name (),
+                              (guint) getuid (), lanes [i].name);
+
+      /* first 64 bits of the digest */
+      digest = g_compute_checksum_for_string (G_CHECKSUM_SHA256, seed, -1);
+      digest [16] = '\0';
+      lanes [i].phase = g_ascii_strtoull (digest, NULL, 16);
+
+      g_free (digest);
+      g_free (seed);
+    }
+
+  g_free (machine_id);
+}
+
+/*
+ * delay to the next slot of the lane on the wall-clock grid
+ */
+static guint
+poll_phase_delay (poll_lane  *lane,
+                  guint       interval)
+{
+  guint64 now;
+  guint delay;
+
+  if (replay_index)
+    return replay_poll_delay (lane, interval);
+
+  if (opt_no_phase || (interval == 0))
+    return interval;
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  delay = (guint) ((lane->phase % interval + interval - now % interval) % interval);
+
+  /* we are in the slot right now - it was just polled */
+  return delay ? delay : interval;
+}
+
+
+/*
+ * poll scheduler
+ */
+static gboolean scheduled_poll (gpointer user_data);
+
+static gboolean
+schedule_poll (poll_lane  *lane,
+               guint       delay)
+{
+  lane->source = g_timeout_add_seconds (delay, scheduled_poll, lane);
+  if (!lane->source)
+    return FALSE;
+
+  lane->next = g_get_monotonic_time () + (gint64) delay * G_USEC_PER_SEC;
+
+  if (opt_prewarm && (delay > opt_prewarm_lead))
+    lane->prewarm_source = g_timeout_add_seconds (delay - opt_prewarm_lead, prewarm_connection, lane);
+
+  return TRUE;
+}
+
+static gboolean
+scheduled_poll (gpointer user_data)
+{
+  trace_span *cycle, *span;
+  poll_lane *lane;
+  guint backoff, interval;
+
+  lane = (poll_lane*) user_data;
+  lane->source = 0;
+  lane->polls++;
+
+  cycle = trace_begin ("poll", "cycle");
+
+  /* each lane revalidates against its own 'Last-Modified' */
+  last_mod = lane->last_mod;
+  check_github_notifications (lane);
+  lane->last_mod = last_mod;
+  catch_up_finish (lane);
+
+  status_publish ();
+
+  /* don't poll before the rate limit deadline, slow down while the user is away */
+  span = trace_begin ("schedule", "cycle");
+  backoff = host_backoff_remaining (host_lookup (lane->url));
+  interval = user_idle ? MAX (opt_idle_interval, *lane->interval) : *lane->interval;
+  schedule_poll (lane, MAX (poll_phase_delay (lane, interval), backoff));
+  trace_end (span, NULL);
+
+  trace_end (cycle, lane->name);
+  trace_flush ();
+
+  return FALSE;
+}
+
+
+/*
+ * poll right now instead of waiting for the scheduled poll
+ */
+static void
+poll_now (void)
+{
+  guint i;
+
+  for (i = 0; i < LANES; i++)
+    {
+      if (!lanes [i].enabled)
+        continue;
+
+      if (lanes [i].source)
+        g_source_remove (lanes [i].source);
+      if (lanes [i].prewarm_source)
+        g_source_remove (lanes [i].prewarm_source);
+
+      lanes [i].prewarm_source = 0;
+      lanes [i].source = g_idle_add (scheduled_poll, &lanes [i]);
+    }
+}
+
+
+/*
+ * D-Bus interface of the running instance
+ */
+static void
+handle_method_call (GDBusConnection        *connection,
+                    const gchar            *sender,
+                    const gchar            *object_path,
+                    const gchar            *interface_name,
+                    const gchar            *method_name,
+                    GVariant               *parameters,
+                    GDBusMethodInvocation  *invocation,
+                    gpointer                user_data)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  store_entry *entry;
+  const gchar *id;
+
+  /* queries from panel widgets and prompts */
+  if (!g_strcmp0 (method_name, "GetUnreadCount"))
+    {
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", g_hash_table_size (store)));
+      return;
+    }
+  else if (!g_strcmp0 (method_name, "GetCountsByReason"))
+    {
+      g_dbus_method_invocation_return_value (invocation, store_counts (TRUE));
+      return;
+    }
+  else if (!g_strcmp0 (method_name, "GetCountsByRepository"))
+    {
+      g_dbus_method_invocation_return_value (invocation, store_counts (FALSE));
+      return;
+    }
+  else if (!g_strcmp0 (method_name, "List"))
+    {
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+
+      g_hash_table_iter_init (&iter, store);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &entry))
+        g_variant_builder_add_value (&builder, store_entry_to_variant (entry));
+
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(aa{sv})", &builder));
+      return;
+    }
+  else if (!g_strcmp0 (method_name, "Get"))
+    {
+      g_variant_get (parameters, "(&s)", &id);
+
+      entry = g_hash_table_lookup (store, id);
+      if (!entry)
+        {
+          g_dbus_method_invocation_return_dbus_error (invocation, DBUS_ERROR_NOT_FOUND, "no such notification");
+          return;
+        }
+
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@a{sv})", store_entry_to_variant (entry)));
+      return;
+    }
+
+  print_log (LOG_INFO, "D-Bus request: method=%s sender=%s\n", method_name, sender);
+
+  if (!g_strcmp0 (method_name, "PollNow"))
+    poll_now ();
+  else if (!g_strcmp0 (method_name, "Quit"))
+    g_main_loop_quit (mainloop);
+
+  g_dbus_method_invocation_return_value (invocation, NULL);
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+  handle_method_call,
+  NULL,
+  NULL
+};
+
+
+/*
+ * claim well-known bus name, there can be only one polling instance
+ */
+static void
+bus_name_acquired (GDBusConnection  *connection,
+                   const gchar      *name,
+                   gpointer          user_data)
+{
+  bus_name_state = BUS_NAME_OWNED;
+}
+
+static void
+bus_name_lost (GDBusConnection  *connection,
+               const gchar      *name,
+               gpointer          user_data)
+{
+  if (bus_name_state == BUS_NAME_OWNED)
+    print_log (LOG_WARNING, "lost D-Bus name '%s'\n", name);
+
+  bus_name_state = BUS_NAME_LOST;
+}
+
+static bus_name_result
+claim_bus_name (GDBusConnection *bus)
+{
+  GVariant *reply;
+  GError *error;
+  gboolean has_owner;
+
+  error = NULL;
+
+  bus_name_state = BUS_NAME_PENDING;
+  bus_name_id = g_bus_own_name_on_connection (bus, DBUS_NAME, G_BUS_NAME_OWNER_FLAGS_DO_NOT_QUEUE,
+                                              bus_name_acquired, bus_name_lost, NULL, NULL);
+
+  /* nothing else is attached to the main context yet */
+  while (bus_name_state == BUS_NAME_PENDING)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (bus_name_state == BUS_NAME_OWNED)
+    return BUS_NAME_OWNED;
+
+  /* lost covers both a taken name and a failed request - ask who owns it */
+  reply = g_dbus_connection_call_sync (bus, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "NameHasOwner",
+                                       g_variant_new ("(s)", DBUS_NAME),
+                                       G_VARIANT_TYPE ("(b)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+  if (!reply)
+    {
+      print_log (LOG_ERR, "cannot request D-Bus name: %s\n", error->message);
+      g_error_free (error);
+      return BUS_NAME_LOST;
+    }
+
+  g_variant_get (reply, "(b)", &has_owner);
+  g_variant_unref (reply);
+
+  if (!has_owner)
+    {
+      print_log (LOG_ERR, "cannot request D-Bus name '%s'\n", DBUS_NAME);
+      return BUS_NAME_LOST;
+    }
+
+  return BUS_NAME_TAKEN;
+}
+
+
+/*
+ * forward commandline request to the running instance
+ */
+static gboolean
+forward_request (GDBusConnection  *bus,
+                 const gchar      *method)
+{
+  GVariant *reply;
+  GError *error;
+
+  error = NULL;
+
+  reply = g_dbus_connection_call_sync (bus, DBUS_NAME, DBUS_PATH, DBUS_INTERFACE, method,
+                                       NULL, NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+  if (!reply)
+    {
+      print_log (LOG_ERR, "cannot forward '%s' request: %s\n", method, error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  g_variant_unref (reply);
+  return TRUE;
+}
+
+
+/*
+ * user presence - logind IdleHint/LockedHint and screensaver state
+ */
+static void
+update_idle_state (void)
+{
+  GVariant *value;
+  gboolean idle;
+  guint i;
+
+  idle = screensaver_active;
+
+  if (logind_session)
+    {
+      value = g_dbus_proxy_get_cached_property (logind_session, "IdleHint");
+      if (value)
+        {
+          idle |= g_variant_get_boolean (value);
+          g_variant_unref (value);
+        }
+
+      value = g_dbus_proxy_get_cached_property (logind_session, "LockedHint");
+      if (value)
+        {
+          idle |= g_variant_get_boolean (value);
+          g_variant_unref (value);
+        }
+    }
+
+  if (idle == user_idle)
+    return;
+
+  user_idle = idle;
+
+  if (user_idle)
+    {
+      print_log (LOG_INFO, "user is away - polling interval=%dsec\n", opt_idle_interval);
+      return;
+    }
+
+  /* one catch-up poll of every lane shows everything what happened in the meantime */
+  print_log (LOG_INFO, "user is back - catch-up poll\n");
+  for (i = 0; i < LANES; i++)
+    lanes [i].catch_up = lanes [i].enabled;
+  catch_up = TRUE;
+  poll_now ();
+
+  /* watched repositories are back at the full rate */
+  if (watch_source)
+    {
+      g_source_remove (watch_source);
+      watch_source = g_idle_add (watch_tick, NULL);
+    }
+}
+
+static void
+logind_properties_changed (GDBusProxy  *proxy,
+                           GVariant    *changed_properties,
+                           GStrv        invalidated_properties,
+                           gpointer     user_data)
+{
+  update_idle_state ();
+}
+
+static void
+screensaver_active_changed (GDBusConnection  *connection,
+                            const gchar      *sender_name,
+                            const gchar      *object_path,
+                            const gchar      *interface_name,
+                            const gchar      *signal_name,
+                            GVariant         *parameters,
+                            gpointer          user_data)
+{
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(b)")))
+    return;
+
+  g_variant_get (parameters, "(b)", &screensaver_active);
+  update_idle_state ();
+}
+
+static void
+watch_user_presence (GDBusConnection *bus)
+{
+  GVariant *reply;
+  GError *error;
+
+  error = NULL;
+
+  /* logind session of the user - 'auto' works outside of the session too */
+  logind_session = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM, G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START, NULL,
+                                                  "org.freedesktop.login1", LOGIND_SESSION_PATH,
+                                                  "org.freedesktop.login1.Session", NULL, &error);
+  if (logind_session)
+    g_signal_connect (logind_session, "g-properties-changed", G_CALLBACK (logind_properties_changed), NULL);
+  else
+    {
+      print_log (LOG_INFO, "logind session not available: %s\n", error->message);
+      g_clear_error (&error);
+    }
+
+  /* screensaver - desktops without logind hints */
+  screensaver_watch = g_dbus_connection_signal_subscribe (bus, NULL, "org.freedesktop.ScreenSaver", "ActiveChanged",
+                                                          NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+                                                          screensaver_active_changed, NULL, NULL);
+
+  reply = g_dbus_connection_call_sync (bus, "org.freedesktop.ScreenSaver", "/org/freedesktop/ScreenSaver",
+                                       "org.freedesktop.ScreenSaver", "GetActive", NULL, G_VARIANT_TYPE ("(b)"),
+                                       G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_TIMEOUT, NULL, NULL);
+  if (reply)
+    {
+      g_variant_get (reply, "(b)", &screensaver_active);
+      g_variant_unref (reply);
+    }
 
-  g_free (notif->repository);
-  g_free (notif->repository_url);
-  g_free (notif->type);
-  g_free (notif->title);
-  g_free (notif->user);
-  g_free (notif->user_avatar);
-  g_free (notif->reason);
+  update_idle_state ();
 }
 
 
 /*
- * check GitHub notifications status
+ * do-not-disturb - GNOME 'show-banners' and KDE 'Inhibited' property
  */
-static gboolean
-check_github_notifications (gpointer user_data)
+static void
+update_dnd_state (void)
 {
-  NotifyNotification *error;
-  GList *notifications_list;
-  json_t *json_root, *json_local_root;
-  json_error_t json_error;
-  gchar *curl_response;
-  guint json_cnt;
-  glong return_code;
+  GVariant *value;
+  gboolean dnd;
 
-  error = NULL;
-  notifications_list = NULL;
-  json_root = NULL;
-  curl_response = NULL;
-
-  /* list all notifications */
-  curl_response = curl_request (GITHUB_API_NOTIFICATIONS, TRUE, &return_code);
-  if (curl_response == NULL)
-    goto error;
+  dnd = FALSE;
 
-  /* decode received JSON string */
-  json_root = json_loads (curl_response, 0, &json_error);
-  g_free (curl_response);
+  if (gnome_notifications)
+    dnd |= !g_settings_get_boolean (gnome_notifications, "show-banners");
 
-  if (!json_root)
+  if (notification_server)
     {
-      print_log (LOG_ERR, "JSON error: on line %d: %s\n", json_error.line, json_error.text);
-      goto error;
+      value = g_dbus_proxy_get_cached_property (notification_server, "Inhibited");
+      if (value)
+        {
+          if (g_variant_is_of_type (value, G_VARIANT_TYPE_BOOLEAN))
+            dnd |= g_variant_get_boolean (value);
+          g_variant_unref (value);
+        }
     }
 
-  if (!json_is_array(json_root))
+  if (dnd == dnd_active)
+    return;
+
+  dnd_active = dnd;
+
+  if (dnd_active)
     {
-      print_log (LOG_ERR, "JSON error: root is not an array\n");
-      json_decref (json_root);
-      goto error;
+      print_log (LOG_INFO, "do-not-disturb on - queueing notifications\n");
+      return;
     }
 
-  /* iterate over notifications array */
-  for (json_cnt = 0; json_cnt < json_array_size (json_root); ++json_cnt)
+  print_log (LOG_INFO, "do-not-disturb off - queued notifications=%u\n", g_list_length (dnd_queue));
+
+  if (!dnd_queue)
+    return;
+
+  /* nobody would see it now - hand the queue over to the catch-up digest */
+  if (user_idle)
     {
-      notification *notif;
-      json_t *json_notification, *json_obj;
-      json_t *json_subject, *json_repository;
+      idle_backlog = merge_backlog (idle_backlog, dnd_queue, IDLE_BACKLOG_MAX, 0, NULL);
+      dnd_queue = NULL;
+      return;
+    }
 
-      curl_response = NULL;
-      json_notification = NULL;
-      json_obj = NULL;
-      json_subject = NULL;
-      json_repository = NULL;
+  stats.dnd_digests++;
+  show_digest (dnd_queue, "while notifications were paused");
 
-      /* allocate memory for new notification */
-      notif = g_new0 (notification, 1);
+  g_list_foreach (dnd_queue, free_notification, NULL);
+  g_list_free (dnd_queue);
+  dnd_queue = NULL;
 
-      json_notification = json_array_get (json_root, json_cnt);
-      if (!json_is_object (json_notification))
-        goto skip;
+  metrics_write ();
+}
 
-      /* read notification reason */
-      json_obj = json_object_get (json_notification, "reason");
-      if (json_is_string (json_obj))
-        notif->reason = g_strdup (json_string_value (json_obj));
-      else
-        goto skip;
+static void
+gnome_notifications_changed (GSettings    *settings,
+                             const gchar  *key,
+                             gpointer      user_data)
+{
+  update_dnd_state ();
+}
 
-      /* read notification subject */
-      json_subject = json_object_get (json_notification, "subject");
-      if (!json_is_object (json_subject))
-        goto skip;
+static void
+notification_server_changed (GDBusProxy  *proxy,
+                             GVariant    *changed_properties,
+                             GStrv        invalidated_properties,
+                             gpointer     user_data)
+{
+  update_dnd_state ();
+}
 
-      /* read notification type */
-      json_obj = json_object_get (json_subject, "type");
-      if (json_is_string (json_obj))
-        notif->type = g_strdup (json_string_value (json_obj));
-      else
-        goto skip;
+static void
+watch_do_not_disturb (GDBusConnection *bus)
+{
+  GSettingsSchemaSource *source;
+  GSettingsSchema *schema;
+  GError *error;
 
-      /* read notification title */
-      json_obj = json_object_get (json_subject, "title");
-      if (json_is_string (json_obj))
-        notif->title = g_strdup (json_string_value (json_obj));
-      else
-        goto skip;
+  error = NULL;
 
-      json_repository = json_object_get (json_notification, "repository");
-      if (!json_is_object (json_repository))
-        goto skip;
+  /* GNOME Shell */
+  source = g_settings_schema_source_get_default ();
+  schema = source ? g_settings_schema_source_lookup (source, GNOME_NOTIFICATIONS_SCHEMA, TRUE) : NULL;
+  if (schema)
+    {
+      if (g_settings_schema_has_key (schema, "show-banners"))
+        {
+          gnome_notifications = g_settings_new_full (schema, NULL, NULL);
+          g_signal_connect (gnome_notifications, "changed::show-banners",
+                            G_CALLBACK (gnome_notifications_changed), NULL);
+        }
+      g_settings_schema_unref (schema);
+    }
 
-      /* read reposiotry name */
-      json_obj = json_object_get (json_repository, "name");
-      if (json_is_string (json_obj))
-        notif->repository = g_strdup (json_string_value (json_obj));
-      else
-        goto skip;
+  /* KDE Plasma - other servers just don't have the property */
+  notification_server = g_dbus_proxy_new_sync (bus, G_DBUS_PROXY_FLAGS_NONE, NULL,
+                                               "org.freedesktop.Notifications", "/org/freedesktop/Notifications",
+                                               "org.freedesktop.Notifications", NULL, &error);
+  if (notification_server)
+    g_signal_connect (notification_server, "g-properties-changed", G_CALLBACK (notification_server_changed), NULL);
+  else
+    {
+      print_log (LOG_INFO, "can't watch notification server: %s\n", error->message);
+      g_clear_error (&error);
+    }
 
-      /* read url to repository */
-      json_obj = json_object_get (json_repository, "html_url");
-      if (json_is_string (json_obj))
-        notif->repository_url = g_strdup (json_string_value (json_obj));
-      else
-        goto skip;
+  update_dnd_state ();
+}
 
-      /* let's request some additional info: user name and user avatar */
-      json_obj = json_object_get (json_subject, "latest_comment_url");
-      if (json_is_string (json_obj))
-        {
-          json_t *json_user;
-          guint32 json_user_id;
 
-          json_local_root = NULL;
-          json_user = NULL;
+/*
+ * main loop watchdog - a heartbeat source in the loop, a thread that
+ * logs when it stops beating and keeps the systemd watchdog fed while
+ * the loop or the transfers of a poll cycle make progress
+ */
+static gboolean
+watchdog_heartbeat (gpointer user_data)
+{
+  gint64 now, last;
 
-          curl_response = curl_request (json_string_value (json_obj), FALSE, &return_code);
-          if (curl_response == NULL)
-            goto skip;
+  now = g_get_monotonic_time ();
+  last = __atomic_load_n (&loop_heartbeat, __ATOMIC_RELAXED);
 
-          json_local_root = json_loads (curl_response, 0, &json_error);
-          g_free (curl_response);
+  histogram_observe (&stats.loop_lag, (gdouble) MAX (0, now - last - WATCHDOG_TICK * 1000) / G_USEC_PER_SEC);
+  __atomic_store_n (&loop_heartbeat, now, __ATOMIC_RELEASE);
 
-          if (!json_local_root)
-            {
-              print_log (LOG_ERR, "JSON error: on line %d: %s\n", json_error.line, json_error.text);
-              goto skip;
-            }
+  return TRUE;
+}
 
-          json_user = json_object_get (json_local_root, "user");
-          if (!json_is_object (json_user))
-            {
-              json_decref (json_local_root);
-              goto skip;
-            }
+static gpointer
+watchdog_run (gpointer data)
+{
+  const gchar *stage;
+  gint64 threshold, period, lag, now, beat;
+  gboolean stalled;
 
-          /* read user login */
-          json_obj = json_object_get (json_user, "login");
-          if (json_is_string (json_obj))
-            notif->user = g_strdup (json_string_value (json_obj));
-          else
-            {
-              json_decref (json_local_root);
-              goto skip;
-            }
+  threshold = (gint64) opt_stall_threshold * 1000;
+  period = GPOINTER_TO_SIZE (data);
+  stalled = FALSE;
 
-          /* read user ID */
-          json_obj = json_object_get (json_user, "id");
-          if (json_is_number (json_obj))
-            json_user_id = (guint32) json_number_value (json_obj);
-          else
-            {
-              json_decref (json_local_root);
-              goto skip;
-            }
+  g_mutex_lock (&watchdog_mutex);
+  while (!watchdog_stop)
+    {
+      g_cond_wait_until (&watchdog_cond, &watchdog_mutex, g_get_monotonic_time () + period);
+      if (watchdog_stop)
+        break;
 
-          /* read url to avatar */
-          if (!opt_no_avatar)
+      now = g_get_monotonic_time ();
+      beat = __atomic_load_n (&loop_heartbeat, __ATOMIC_ACQUIRE);
+      lag = now - beat - WATCHDOG_TICK * 1000;
+
+      /* log a stall once, with the stage the loop is stuck in */
+      if (threshold && (lag > threshold))
+        {
+          if (!stalled)
             {
-              json_obj = json_object_get (json_user, "avatar_url");
-              if (json_is_string (json_obj))
-                notif->user_avatar = prepare_avatar (json_user_id, json_string_value (json_obj));
-              else
-                {
-                  json_decref (json_local_root);
-                  goto skip;
-                }
+              stage = __atomic_load_n (&loop_stage, __ATOMIC_ACQUIRE);
+              print_log (LOG_WARNING, "main loop stalled for %" G_GINT64_FORMAT "ms in %s\n",
+                         lag / 1000, stage ? stage : "a source outside the poll cycle");
+              __atomic_add_fetch (&stats.loop_stalls, 1, __ATOMIC_RELAXED);
+              stalled = TRUE;
             }
-          else
-            notif->user_avatar = NULL;
-
-          json_decref (json_local_root);
         }
       else
-        goto skip;
-
-      /* append new notification to 'notifications_list' */
-      print_log (LOG_INFO, "new notification: respository=%s type=%s reason=%s\n",
-                 notif->repository, notif->type, notif->reason);
-      notifications_list = g_list_append (notifications_list, notif);
-      continue;
+        {
+          if (stalled)
+            print_log (LOG_INFO, "main loop recovered\n");
+          stalled = FALSE;
+        }
 
-skip:
-      /* upss... something goes wrong */
-      print_log (LOG_INFO, "invalid notification - %p\n", notif);
-      free_notification (notif, NULL);
-      continue;
+#ifdef HAVE_SYSTEMD
+      /* a slow poll cycle is fine as long as its transfers move,
+         only a loop stuck for half the systemd timeout gets us restarted */
+      beat = MAX (beat, __atomic_load_n (&loop_progress, __ATOMIC_ACQUIRE));
+      if (watchdog_usec && (now - beat - WATCHDOG_TICK * 1000 < (gint64) watchdog_usec / 2))
+        sd_notify (0, "WATCHDOG=1");
+#endif
     }
+  g_mutex_unlock (&watchdog_mutex);
 
-  /* show all received notifications */
-  g_list_foreach (notifications_list, show_notification, NULL);
+  return NULL;
+}
 
-  /* clean up */
-  g_list_foreach (notifications_list, free_notification, NULL);
-  g_list_free (notifications_list);
-  json_decref (json_root);
+static guint
+watchdog_start (void)
+{
+  gint64 period;
 
-  return TRUE;
+  watchdog_usec = 0;
+#ifdef HAVE_SYSTEMD
+  if (sd_watchdog_enabled (0, &watchdog_usec) <= 0)
+    watchdog_usec = 0;
+#endif
 
-error:
+  if (!opt_stall_threshold && !watchdog_usec)
+    return 0;
 
-  /* it's not error - we just don't have any new notifications to show */
-  if (return_code == RESPONSE_CODE_NOT_MODIFIED)
-    return TRUE;
+  /* check twice per threshold and four times per systemd watchdog timeout */
+  period = opt_stall_threshold ? (gint64) opt_stall_threshold * 1000 / 2 : G_MAXINT64;
+  if (watchdog_usec)
+    period = MIN (period, (gint64) watchdog_usec / 4);
 
-  /* show error notification */
-  if (return_code == RESPONSE_CODE_UNAUTHORIZED)
-    error = notify_notification_new ("'github-notifyd' authorization error - please check access token value", NULL, NULL);
-  else
-    error = notify_notification_new ("'github-notifyd' undefinded error - please check the logs for more information", NULL, NULL);
+  loop_heartbeat = g_get_monotonic_time ();
+  loop_progress = loop_heartbeat;
+  watchdog = g_thread_new ("watchdog", watchdog_run, GSIZE_TO_POINTER (period));
 
-  notify_notification_set_timeout (error, NOTIFY_EXPIRES_DEFAULT);
-  notify_notification_set_urgency (error, NOTIFY_URGENCY_CRITICAL);
-  notify_notification_show (error, NULL);
+  return g_timeout_add (WATCHDOG_TICK, watchdog_heartbeat, NULL);
+}
 
-  g_object_unref (G_OBJECT(error));
-  return TRUE;
+static void
+watchdog_finish (void)
+{
+  if (!watchdog)
+    return;
+
+  g_mutex_lock (&watchdog_mutex);
+  watchdog_stop = TRUE;
+  g_cond_signal (&watchdog_cond);
+  g_mutex_unlock (&watchdog_mutex);
+
+  g_thread_join (watchdog);
+  watchdog = NULL;
 }
 
 
@@ -754,11 +6448,23 @@ main (int argc, char **argv)
   GList           *server_caps;
   GOptionContext  *option_context;
   GError          *error;
-  gint signal_id, exit_value;
+  GDBusConnection *bus;
+  GDBusNodeInfo   *introspection_data;
+  guint registration_id, heartbeat_id, i;
+  gchar **thresholds;
+  guint64 threshold;
+  struct sigaction dump_action;
+  gint signal_id, dump_signal_id, exit_value;
 
   server_caps = NULL;
   option_context = NULL;
   error = NULL;
+  bus = NULL;
+  introspection_data = NULL;
+  registration_id = 0;
+  signal_id = 0;
+  dump_signal_id = 0;
+  heartbeat_id = 0;
   exit_value = EXIT_SUCCESS;
 
   /* parse commandline options */
@@ -772,8 +6478,11 @@ main (int argc, char **argv)
       goto exit;
     }
 
-  /* deamonize */
-  if (!opt_no_daemon)
+  /*
+   * deamonize - GDBus isn't fork-safe, so it has to be done before connecting to the bus;
+   * requests for a running instance stay in the foreground to report the result
+   */
+  if (!opt_no_daemon && !opt_quit && !opt_poll_now)
     daemonize();
 
   /* open syslog */
@@ -781,15 +6490,114 @@ main (int argc, char **argv)
   openlog ("GitHub Notifications Daemon", LOG_NOWAIT|LOG_PID, LOG_USER);
 #endif
 
+  /* connect to the session bus */
+  bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  if (!bus)
+    {
+      print_log (LOG_ERR, "cannot connect to the session bus: %s\n", error->message);
+      g_error_free (error);
+      exit_value = EXIT_FAILURE;
+      goto exit;
+    }
+
   /* initialize mainloop */
   mainloop = g_main_loop_new (NULL, FALSE);
 
+  /* export D-Bus interface - before the name is claimed, so no request can miss it */
+  introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+  registration_id = g_dbus_connection_register_object (bus, DBUS_PATH, introspection_data->interfaces[0],
+                                                       &interface_vtable, NULL, NULL, &error);
+  if (!registration_id)
+    {
+      print_log (LOG_ERR, "cannot export D-Bus interface: %s\n", error->message);
+      g_error_free (error);
+      exit_value = EXIT_FAILURE;
+      goto exit;
+    }
+
+  /* another instance is running - forward the request instead of polling twice */
+  switch (claim_bus_name (bus))
+    {
+      case BUS_NAME_OWNED:
+        break;
+      case BUS_NAME_TAKEN:
+        if (opt_quit)
+          exit_value = forward_request (bus, "Quit") ? EXIT_SUCCESS : EXIT_FAILURE;
+        else if (opt_poll_now)
+          exit_value = forward_request (bus, "PollNow") ? EXIT_SUCCESS : EXIT_FAILURE;
+        else
+          print_log (LOG_INFO, "github-notifyd is already running\n");
+        goto exit;
+      default:
+        exit_value = EXIT_FAILURE;
+        goto exit;
+    }
+
+  if (opt_quit)
+    {
+      print_log (LOG_INFO, "github-notifyd is not running\n");
+      goto exit;
+    }
+
+  service_bus = bus;
+  store = store_new ();
+  mark_read_threads = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  mark_read_repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  /* initialize curl - connections are kept in the multi handle between requests */
+  curl_global_init (CURL_GLOBAL_ALL);
+  multi = curl_multi_init ();
+  share = curl_share_init ();
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  hosts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, host_state_free);
+  negative_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  if (opt_cache_size > 0)
+    http_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cache_entry_free);
+
+  /* avatars outlive the session - they are kept in the cache directory */
+  avatar_dir = g_build_filename (g_get_user_cache_dir (), "github-notifyd", AVATAR_DIR, NULL);
+  if (g_mkdir_with_parents (avatar_dir, 0700) < 0)
+    print_log (LOG_ERR, "cannot create avatar directory '%s'\n", avatar_dir);
+  avatar_index = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, avatar_entry_free);
+  avatar_index_load ();
+  avatar_remove_legacy ();
+
+  /* metrics are exported to the runtime directory by default */
+  if (!opt_metrics_file)
+    opt_metrics_file = g_build_filename (g_get_user_runtime_dir (), METRICS_FILE, NULL);
+
+  /* status snapshot is published even before the first poll */
+  if (!opt_status_file)
+    opt_status_file = g_build_filename (g_get_user_runtime_dir (), GITHUB_NOTIFYD_STATUS_FILE, NULL);
+  status_open ();
+
+  /* tracing is off unless a trace file was given */
+  if (opt_trace_file)
+    trace_buffer = g_string_new (NULL);
+
   /* initialize libnotify */
   notify_init ("GitHub Notifications Daemon");
 
   /* handle SIGINT */
   signal_id = g_unix_signal_add (SIGINT, sigint_handler, NULL);
 
+  /* dump the internal state on SIGUSR1 - also in the middle of a poll cycle */
+  if (g_unix_open_pipe (dump_pipe, FD_CLOEXEC, NULL) &&
+      g_unix_set_fd_nonblocking (dump_pipe[0], TRUE, NULL) &&
+      g_unix_set_fd_nonblocking (dump_pipe[1], TRUE, NULL))
+    {
+      memset (&dump_action, 0, sizeof (dump_action));
+      dump_action.sa_handler = sigusr1_handler;
+      dump_action.sa_flags = SA_RESTART;
+      sigemptyset (&dump_action.sa_mask);
+      sigaction (SIGUSR1, &dump_action, NULL);
+
+      dump_signal_id = g_unix_fd_add (dump_pipe[0], G_IO_IN, dump_pipe_ready, NULL);
+    }
+  else
+    print_log (LOG_ERR, "cannot create state dump pipe\n");
+
   /* check notifications server capabilities */
   server_caps = notify_get_server_caps();
   if (!server_caps)
@@ -814,37 +6622,244 @@ main (int argc, char **argv)
              name, vendor, version, spec_version);
 
   /* check polling interval value */
-  if (opt_interval < 45)
+  if (opt_interval < MIN_POLLING_INTERVAL)
     {
       print_log (LOG_ERR, "minimal polling interval value is 45 seconds\n");
-      opt_interval = 45;
+      opt_interval = MIN_POLLING_INTERVAL;
+    }
+
+  /* histograms - seconds to minutes for notifications, milliseconds for the loop */
+  for (i = 0; i < TTN_LAST; i++)
+    stats.ttn[i].bounds = ttn_buckets;
+  stats.loop_lag.bounds = lag_buckets;
+
+  /* time-to-notify objectives */
+  thresholds = g_strsplit (opt_slo_thresholds ? opt_slo_thresholds : SLO_THRESHOLDS, ",", -1);
+  for (i = 0; thresholds [i]; i++)
+    {
+      if ((slo_count == SLO_MAX) ||
+          !g_ascii_string_to_unsigned (g_strstrip (thresholds [i]), 10, 1, G_MAXUINT, &threshold, NULL))
+        {
+          print_log (LOG_ERR, "invalid SLO threshold '%s' - expected at most %d positive numbers of seconds\n",
+                     thresholds [i], SLO_MAX);
+          g_strfreev (thresholds);
+          exit_value = EXIT_FAILURE;
+          goto exit;
+        }
+
+      slo_thresholds [slo_count++] = (guint) threshold;
+    }
+  g_strfreev (thresholds);
+
+  /* threads enriched up front in lazy mode */
+  eager_reasons = g_strsplit (opt_eager_reasons ? opt_eager_reasons : EAGER_REASONS, ",", -1);
+  for (i = 0; eager_reasons[i]; i++)
+    g_strstrip (eager_reasons[i]);
+
+  /* single lane - the complete feed with the short interval */
+  if (opt_full_interval == 0)
+    {
+      lanes [LANE_PARTICIPATING].enabled = FALSE;
+      lanes [LANE_ALL].interval = &opt_interval;
+    }
+  else if (opt_full_interval < opt_interval)
+    {
+      print_log (LOG_ERR, "full polling interval can't be shorter than polling interval\n");
+      opt_full_interval = opt_interval;
+    }
+
+  if (opt_watch_repos && (opt_watch_interval < WATCH_MIN_INTERVAL))
+    {
+      print_log (LOG_ERR, "minimal watch interval value is %d seconds\n", WATCH_MIN_INTERVAL);
+      opt_watch_interval = WATCH_MIN_INTERVAL;
+    }
+
+  /* recorded traffic instead of the network */
+  if (opt_record_dir && opt_replay_dir)
+    {
+      print_log (LOG_ERR, "--record and --replay can't be used together\n");
+      exit_value = EXIT_FAILURE;
+      goto exit;
+    }
+
+  if (opt_record_dir && (g_mkdir_with_parents (opt_record_dir, 0700) < 0))
+    {
+      print_log (LOG_ERR, "cannot create record directory '%s'\n", opt_record_dir);
+      exit_value = EXIT_FAILURE;
+      goto exit;
     }
 
-  /* set 'check_github_notifications' callback function */
-  if (!g_timeout_add_seconds (opt_interval, check_github_notifications, NULL))
+  if (opt_record_dir && !record_open (opt_record_dir))
     {
-      print_log (LOG_ERR, "can't set 'check_github_notifications' callback fuction\n");
       exit_value = EXIT_FAILURE;
       goto exit;
     }
 
+  if (opt_replay_dir)
+    {
+      if (!replay_load (opt_replay_dir))
+        {
+          exit_value = EXIT_FAILURE;
+          goto exit;
+        }
+
+      /* duplicated requests would take recordings of other requests */
+      opt_hedge = FALSE;
+      opt_prewarm = FALSE;
+    }
+
+  /* schedule first 'check_github_notifications' call of each lane */
+  shown_threads = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  init_poll_phase ();
+  for (i = 0; i < LANES; i++)
+    if (lanes [i].enabled && !schedule_poll (&lanes [i], poll_phase_delay (&lanes [i], *lanes [i].interval)))
+      {
+        print_log (LOG_ERR, "can't set 'check_github_notifications' callback fuction\n");
+        exit_value = EXIT_FAILURE;
+        goto exit;
+      }
+
+  /* watch whether the user is around */
+  if (opt_idle_interval > 0)
+    watch_user_presence (bus);
+
+  /* hold notifications back while the desktop is in do-not-disturb mode */
+  if (!opt_ignore_dnd)
+    watch_do_not_disturb (bus);
+
+  if (opt_poll_now)
+    poll_now ();
+
+  /* second source - events of watched repositories */
+  if (opt_watch_repos)
+    watch_start ();
+
   /* enter to mainloop */
-  print_log (LOG_INFO, "mainloop: polling interval=%dsec\n", opt_interval);
+  if (lanes [LANE_PARTICIPATING].enabled)
+    print_log (LOG_INFO, "mainloop: polling interval=%dsec, full feed=%dsec\n", opt_interval, opt_full_interval);
+  else
+    print_log (LOG_INFO, "mainloop: polling interval=%dsec\n", opt_interval);
+  heartbeat_id = watchdog_start ();
   g_main_loop_run (mainloop);
 
 exit:
+  watchdog_finish ();
 
   /* it's over - let's go home */
   print_log (LOG_INFO, "it's over - let's go home\n");
 
   if (signal_id > 0)
     g_source_remove (signal_id);
+  if (dump_signal_id > 0)
+    {
+      signal (SIGUSR1, SIG_DFL);
+      g_source_remove (dump_signal_id);
+      close (dump_pipe[0]);
+      close (dump_pipe[1]);
+    }
+  if (heartbeat_id > 0)
+    g_source_remove (heartbeat_id);
   if (option_context != NULL)
     g_option_context_free (option_context);
   if (mainloop)
     g_main_loop_unref(mainloop);
+  while (!g_queue_is_empty (&action_popups))
+    release_popup (g_queue_peek_head (&action_popups));
   if (notify_is_initted())
     notify_uninit();
+  for (i = 0; i < LANES; i++)
+    {
+      if (lanes [i].source)
+        g_source_remove (lanes [i].source);
+      if (lanes [i].prewarm_source)
+        g_source_remove (lanes [i].prewarm_source);
+    }
+  if (shown_threads)
+    g_hash_table_destroy (shown_threads);
+
+  /* don't lose marks clicked just before quitting */
+  if (mark_read_source)
+    {
+      g_source_remove (mark_read_source);
+      flush_mark_read (NULL);
+      if (mark_read_source)
+        g_source_remove (mark_read_source);
+    }
+  if (watch_source)
+    g_source_remove (watch_source);
+  if (watched_repos)
+    g_ptr_array_free (watched_repos, TRUE);
+  g_strfreev (opt_watch_repos);
+  g_strfreev (eager_reasons);
+  g_free (opt_slo_thresholds);
+  g_free (opt_eager_reasons);
+
+  if (mark_read_threads)
+    g_hash_table_destroy (mark_read_threads);
+  if (mark_read_repos)
+    g_hash_table_destroy (mark_read_repos);
+
+  if (multi)
+    curl_multi_cleanup (multi);
+  if (share)
+    curl_share_cleanup (share);
+  if (hosts)
+    g_hash_table_destroy (hosts);
+  if (http_cache)
+    g_hash_table_destroy (http_cache);
+  if (negative_cache)
+    g_hash_table_destroy (negative_cache);
+  if (replay_index)
+    g_hash_table_destroy (replay_index);
+  g_list_free (replay_pending);
+  status_close ();
+  if (store)
+    g_hash_table_destroy (store);
+  if (avatar_index)
+    {
+      avatar_index_save ();
+      g_hash_table_destroy (avatar_index);
+    }
+  g_free (avatar_dir);
+  if (trace_buffer)
+    {
+      trace_flush ();
+      g_string_free (trace_buffer, TRUE);
+    }
+
+  g_list_foreach (deferred_notifications, free_notification, NULL);
+  g_list_free (deferred_notifications);
+
+  g_list_foreach (idle_backlog, free_notification, NULL);
+  g_list_free (idle_backlog);
+
+  g_list_foreach (dnd_queue, free_notification, NULL);
+  g_list_free (dnd_queue);
+
+  if (gnome_notifications)
+    g_object_unref (gnome_notifications);
+  if (notification_server)
+    g_object_unref (notification_server);
+
+  if (logind_session)
+    g_object_unref (logind_session);
+  if (screensaver_watch)
+    g_dbus_connection_signal_unsubscribe (bus, screensaver_watch);
+  if (bus_name_id)
+    g_bus_unown_name (bus_name_id);
+  if (registration_id)
+    g_dbus_connection_unregister_object (bus, registration_id);
+  if (introspection_data)
+    g_dbus_node_info_unref (introspection_data);
+  if (bus)
+    g_object_unref (bus);
+
+  curl_global_cleanup ();
+  g_free (opt_metrics_file);
+  g_free (opt_status_file);
+  g_free (opt_trace_file);
+  g_free (opt_record_dir);
+  g_free (opt_replay_dir);
 
 #ifndef HAVE_SYSTEMD
   closelog();